@@ -0,0 +1,64 @@
+# Builds libowlsysex.so, the C interface in Source/owlsysex.h, next to
+# the FirmwareSender build:
+#   make -f libowlsysex.mk [CONFIG=Release]
+# ALSA is used through pkg-config as for FirmwareSender; pass
+# CPPFLAGS=-DJUCE_ALSA=0 to build without MIDI devices.
+
+ifndef CONFIG
+  CONFIG=Debug
+endif
+
+ifeq ($(CONFIG),Debug)
+  LIB_OPTFLAGS := -g -ggdb -O0 -DDEBUG=1 -D_DEBUG=1
+else
+  LIB_OPTFLAGS := -Os -DNDEBUG=1
+endif
+
+LIB_OUTDIR := build
+LIB_OBJDIR := build/intermediate/$(CONFIG)/owlsysex
+LIB_TARGET := $(LIB_OUTDIR)/libowlsysex.so
+
+LIB_CPPFLAGS := -MMD -DLINUX=1 $(shell pkg-config --cflags alsa) -pthread \
+  -I../../Source -I../../JuceLibraryCode -I../../JuceLibraryCode/modules $(CPPFLAGS)
+LIB_CFLAGS := $(LIB_CPPFLAGS) $(LIB_OPTFLAGS) -fPIC -fvisibility=hidden $(CFLAGS)
+LIB_CXXFLAGS := $(LIB_CFLAGS) -std=c++14 $(CXXFLAGS)
+LIB_LDFLAGS := -shared $(shell pkg-config --libs alsa) -ldl -lpthread -lrt $(LDFLAGS)
+
+LIB_OBJECTS := \
+  $(LIB_OBJDIR)/owlsysex.o \
+  $(LIB_OBJDIR)/crc32.o \
+  $(LIB_OBJDIR)/sysex.o \
+  $(LIB_OBJDIR)/include_juce_audio_basics.o \
+  $(LIB_OBJDIR)/include_juce_audio_devices.o \
+  $(LIB_OBJDIR)/include_juce_core.o \
+  $(LIB_OBJDIR)/include_juce_events.o
+
+.PHONY: all clean
+
+all : $(LIB_TARGET)
+
+$(LIB_TARGET) : $(LIB_OBJECTS)
+	@echo Linking "libowlsysex"
+	@mkdir -p $(LIB_OUTDIR)
+	$(CXX) -o $@ $(LIB_OBJECTS) $(LIB_LDFLAGS)
+
+$(LIB_OBJDIR)/%.o: ../../Source/%.cpp
+	@mkdir -p $(LIB_OBJDIR)
+	@echo "Compiling $(<F)"
+	$(CXX) $(LIB_CXXFLAGS) -o "$@" -c "$<"
+
+$(LIB_OBJDIR)/%.o: ../../Source/%.c
+	@mkdir -p $(LIB_OBJDIR)
+	@echo "Compiling $(<F)"
+	$(CC) $(LIB_CFLAGS) -o "$@" -c "$<"
+
+$(LIB_OBJDIR)/%.o: ../../JuceLibraryCode/%.cpp
+	@mkdir -p $(LIB_OBJDIR)
+	@echo "Compiling $(<F)"
+	$(CXX) $(LIB_CXXFLAGS) -o "$@" -c "$<"
+
+clean:
+	@echo Cleaning libowlsysex
+	rm -rf $(LIB_TARGET) $(LIB_OBJDIR)
+
+-include $(LIB_OBJECTS:%.o=%.d)
@@ -0,0 +1,251 @@
+#ifndef __FirmwareImage_H__
+#define __FirmwareImage_H__
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include "JuceHeader.h"
+
+#define MAX_FIRMWARE_IMAGE_SIZE (8*1024*1024)
+#define MAX_RAW_IMAGE_SIZE (1024*1024*1024) // keeps offsets and the encoded size within int
+#define ELF_PT_LOAD 1
+
+/*
+ * Firmware input as a flat image plus the address ranges that hold data.
+ * Raw binaries are a single segment; Intel HEX records and ELF loadable
+ * segments may leave gaps, which read as erased flash (0xff). Files are
+ * only parsed as HEX or ELF when asked to, or when their extension says
+ * so: a raw image may well start with the ELF magic.
+ */
+class FirmwareImage {
+public:
+  enum Format {
+    BY_EXTENSION, // .hex or .ihex, .elf, anything else is raw
+    BINARY,
+    ELF,
+    INTEL_HEX
+  };
+
+private:
+  juce::MemoryBlock data;
+  std::vector<juce::Range<int> > segments; // offsets into data, sorted
+  uint32_t baseAddress = 0;
+
+  struct Chunk {
+    uint32_t address;
+    const uint8_t* data;
+    uint32_t size;
+  };
+
+  static uint16_t get16(const uint8_t* p){
+    return p[0] | (p[1] << 8);
+  }
+
+  static uint32_t get32(const uint8_t* p){
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+  }
+
+  juce::Result assemble(juce::Array<Chunk>& chunks){
+    if(chunks.isEmpty())
+      return juce::Result::fail("No loadable data");
+    uint32_t start = chunks[0].address;
+    uint32_t end = start;
+    for(int i=0; i<chunks.size(); ++i){
+      start = std::min(start, chunks[i].address);
+      end = std::max(end, chunks[i].address + chunks[i].size);
+    }
+    if(end - start > MAX_FIRMWARE_IMAGE_SIZE)
+      return juce::Result::fail("Image spans too large an address range");
+    baseAddress = start;
+    data.setSize(end - start);
+    data.fillWith(0xff);
+    for(int i=0; i<chunks.size(); ++i){
+      int offset = chunks[i].address - start;
+      data.copyFrom(chunks[i].data, offset, chunks[i].size);
+      addSegment(juce::Range<int>(offset, offset + chunks[i].size));
+    }
+    return juce::Result::ok();
+  }
+
+  void addSegment(juce::Range<int> range){
+    // keep segments sorted and merge overlapping or adjacent ranges
+    std::vector<juce::Range<int> >::iterator i = segments.begin();
+    while(i != segments.end() && i->getEnd() < range.getStart())
+      i++;
+    while(i != segments.end() && i->getStart() <= range.getEnd()){
+      range = range.getUnionWith(*i);
+      i = segments.erase(i);
+    }
+    segments.insert(i, range);
+  }
+
+  juce::Result loadBinary(const juce::File& file){
+    if(file.getSize() > MAX_RAW_IMAGE_SIZE)
+      return juce::Result::fail("Image too large: "+file.getFullPathName());
+    if(!file.loadFileAsData(data))
+      return juce::Result::fail("Failed to read "+file.getFullPathName());
+    segments.push_back(juce::Range<int>(0, data.getSize()));
+    return juce::Result::ok();
+  }
+
+  static bool isElf(const void* data, size_t size){
+    return size >= 4 && memcmp(data, "\x7f" "ELF", 4) == 0;
+  }
+
+  static Format getFormat(const juce::File& file){
+    juce::String ext = file.getFileExtension().toLowerCase();
+    if(ext == ".hex" || ext == ".ihex")
+      return INTEL_HEX;
+    if(ext == ".elf")
+      return ELF;
+    return BINARY;
+  }
+
+  juce::Result loadElf(const juce::File& file){
+    juce::MemoryMappedFile map(file, juce::MemoryMappedFile::readOnly);
+    if(map.getData() == NULL)
+      return juce::Result::fail("Failed to map "+file.getFullPathName());
+    return loadElf((const uint8_t*)map.getData(), map.getSize());
+  }
+
+  juce::Result loadElf(const uint8_t* elf, size_t size){
+    if(!isElf(elf, size))
+      return juce::Result::fail("Not an ELF file");
+    if(size < 52)
+      return juce::Result::fail("Truncated ELF header");
+    if(elf[4] != 1 || elf[5] != 1)
+      return juce::Result::fail("Only 32-bit little-endian ELF is supported");
+    uint32_t phoff = get32(elf+28);
+    uint16_t phentsize = get16(elf+42);
+    uint16_t phnum = get16(elf+44);
+    if(phentsize < 32 || phoff + (size_t)phnum*phentsize > size)
+      return juce::Result::fail("Invalid ELF program headers");
+    juce::Array<Chunk> chunks;
+    for(int i=0; i<phnum; ++i){
+      const uint8_t* ph = elf + phoff + i*phentsize;
+      uint32_t type = get32(ph);
+      uint32_t offset = get32(ph+4);
+      uint32_t paddr = get32(ph+12); // load address, as objcopy -O binary
+      uint32_t filesz = get32(ph+16);
+      if(type != ELF_PT_LOAD || filesz == 0)
+	continue;
+      if(offset + (size_t)filesz > size)
+	return juce::Result::fail("Invalid ELF segment");
+      Chunk chunk = { paddr, elf+offset, filesz };
+      chunks.add(chunk);
+    }
+    return assemble(chunks);
+  }
+
+  juce::Result loadIntelHex(const juce::File& file){
+    juce::StringArray lines;
+    file.readLines(lines);
+    juce::MemoryBlock records;
+    juce::Array<Chunk> chunks;
+    juce::Array<uint32_t> offsets; // into records, resolved once it stops growing
+    uint32_t upper = 0;
+    for(int n=0; n<lines.size(); ++n){
+      juce::String line = lines[n].trim();
+      if(line.isEmpty())
+	continue;
+      if(!line.startsWithChar(':') || line.length() < 11 || (line.length() & 1) == 0)
+	return juce::Result::fail("Invalid Intel HEX record on line "+juce::String(n+1));
+      juce::MemoryBlock rec;
+      rec.loadFromHexString(line.substring(1));
+      const uint8_t* r = (const uint8_t*)rec.getData();
+      uint8_t sum = 0;
+      for(size_t i=0; i<rec.getSize(); ++i)
+	sum += r[i];
+      if(sum != 0 || rec.getSize() != (size_t)r[0]+5)
+	return juce::Result::fail("Intel HEX checksum error on line "+juce::String(n+1));
+      uint16_t address = (r[1] << 8) | r[2];
+      switch(r[3]){
+      case 0x00: { // data
+	Chunk chunk = { upper + address, NULL, r[0] };
+	offsets.add(records.getSize());
+	records.append(r+4, r[0]);
+	chunks.add(chunk);
+	break;
+      }
+      case 0x01: // end of file
+	n = lines.size();
+	break;
+      case 0x02: // extended segment address
+	upper = ((r[4] << 8) | r[5]) << 4;
+	break;
+      case 0x04: // extended linear address
+	upper = ((r[4] << 8) | r[5]) << 16;
+	break;
+      default: // start addresses
+	break;
+      }
+    }
+    for(int i=0; i<chunks.size(); ++i)
+      chunks.getReference(i).data = (const uint8_t*)records.getData() + offsets[i];
+    return assemble(chunks);
+  }
+
+public:
+  juce::Result load(const juce::File& file, Format format = BY_EXTENSION){
+    data.reset();
+    segments.clear();
+    baseAddress = 0;
+    if(format == BY_EXTENSION)
+      format = getFormat(file);
+    if(format == INTEL_HEX)
+      return loadIntelHex(file);
+    if(format == ELF)
+      return loadElf(file);
+    return loadBinary(file);
+  }
+
+  /* load an image from memory, raw unless it is to be read as ELF */
+  juce::Result load(const void* bytes, size_t size, Format format = BINARY){
+    data.reset();
+    segments.clear();
+    baseAddress = 0;
+    if(format == INTEL_HEX)
+      return juce::Result::fail("Intel HEX is only read from files");
+    if(format == ELF)
+      return loadElf((const uint8_t*)bytes, size);
+    if(size > MAX_RAW_IMAGE_SIZE)
+      return juce::Result::fail("Image too large");
+    data.append(bytes, size);
+    segments.push_back(juce::Range<int>(0, data.getSize()));
+    return juce::Result::ok();
+  }
+
+  const uint8_t* getData() const {
+    return (const uint8_t*)data.getData();
+  }
+
+  int getSize() const {
+    return data.getSize();
+  }
+
+  uint32_t getBaseAddress() const {
+    return baseAddress;
+  }
+
+  bool isSparse() const {
+    return segments.size() != 1 || segments[0] != juce::Range<int>(0, getSize());
+  }
+
+  /* start of the populated range at or after offset, or end if there is none */
+  int nextPopulated(int offset, int end) const {
+    for(size_t i=0; i<segments.size(); ++i)
+      if(segments[i].getEnd() > offset)
+	return std::min(end, std::max(offset, segments[i].getStart()));
+    return end;
+  }
+
+  /* end of the populated range containing offset */
+  int endOfPopulated(int offset) const {
+    for(size_t i=0; i<segments.size(); ++i)
+      if(segments[i].contains(offset))
+	return segments[i].getEnd();
+    return offset;
+  }
+};
+
+#endif // __FirmwareImage_H__
@@ -2,6 +2,7 @@
 #define __FirmwareLoader_H__
 
 #include <math.h>
+#include <string.h>
 #include "crc32.h"
 #include "sysex.h"
 // #include "device.h"
@@ -10,8 +11,268 @@
 // #include "errorhandlers.h"
 // #include "ProgramManager.h"
 #include "ResourceHeader.h"
+#include "OpenWareMidiControl.h"
 
-class FirmwareLoader {
+/*
+ * Storage policies decide where decoded data goes, resolved at compile
+ * time. Each one provides:
+ *   size_t getCapacity()          largest upload it can take
+ *   bool allocate(size_t size)    start an upload of size bytes
+ *   uint8_t* reserve(size_t& len) room for the next len bytes of data
+ *   uint8_t* retain(size_t& len)  the same, holding the installed image
+ *   bool commit(size_t len)       the reserved bytes are final
+ *   bool finish()                 all data received and checked
+ *   void discard()                the upload failed
+ * reserve() and retain() may shorten len, but an upload package must
+ * fit whole. retain() returns NULL when the storage cannot read the
+ * installed image, and copy packages then fail.
+ */
+
+/* decodes in place into one buffer, the resource header in front of the data */
+template<class Derived>
+class ContiguousStorage {
+protected:
+  uint8_t* buffer = NULL;
+  size_t offset = 0;
+public:
+  size_t getCapacity(){
+    return MAX_SYSEX_PAYLOAD_SIZE;
+  }
+
+  bool allocate(size_t size){
+    buffer = static_cast<Derived*>(this)->getBuffer(size);
+    offset = 0;
+    return buffer != NULL;
+  }
+
+  uint8_t* reserve(size_t& len){
+    return buffer + sizeof(ResourceHeader) + offset;
+  }
+
+  /* copy packages keep what is already in the buffer */
+  uint8_t* retain(size_t& len){
+    return reserve(len);
+  }
+
+  bool commit(size_t len){
+    offset += len;
+    return true;
+  }
+
+  bool finish(){
+    return true;
+  }
+
+  void discard(){}
+
+  uint8_t* getData(){
+    return buffer + sizeof(ResourceHeader);
+  }
+
+  ResourceHeader* getResourceHeader(){
+    return (ResourceHeader*)buffer;
+  }
+};
+
+/* device memory set aside by the link script */
+class DeviceStorage : public ContiguousStorage<DeviceStorage> {
+public:
+  /* the buffer holds whatever was loaded last, not the installed resource */
+  uint8_t* retain(size_t& len){
+    return NULL;
+  }
+
+  uint8_t* getBuffer(size_t size){
+#if defined USE_EXTERNAL_RAM
+    extern char _EXTRAM; // defined in link script
+    return (uint8_t*)&_EXTRAM;
+#else
+    // required by devices with no ext mem
+    extern char _PATCHRAM;
+    return (uint8_t*)&_PATCHRAM;
+#endif
+  }
+};
+
+/* decodes and checksums, but keeps nothing; for benchmarks */
+template<size_t ScratchSize = 4096>
+class NullStorage {
+private:
+  uint8_t scratch[ScratchSize];
+public:
+  size_t getCapacity(){
+    return SIZE_MAX;
+  }
+
+  bool allocate(size_t size){
+    return true;
+  }
+
+  uint8_t* reserve(size_t& len){
+    len = len < ScratchSize ? len : ScratchSize;
+    return scratch;
+  }
+
+  uint8_t* retain(size_t& len){
+    return reserve(len);
+  }
+
+  bool commit(size_t len){
+    return true;
+  }
+
+  bool finish(){
+    return true;
+  }
+
+  void discard(){}
+};
+
+/*
+ * Collects data a page at a time and hands full pages to a Writer,
+ * which provides:
+ *   bool begin(size_t size)
+ *   bool write(size_t address, const uint8_t* data, size_t len)
+ *   void read(size_t address, uint8_t* data, size_t len)
+ *   void discard()
+ * Slack past the end of the page takes packages that straddle it.
+ */
+template<class Writer, size_t PageSize, size_t Slack>
+class PageStorage {
+private:
+  uint8_t page[PageSize + Slack];
+  size_t address = 0; // of the page being filled
+  size_t used = 0;
+public:
+  Writer writer;
+
+  size_t getCapacity(){
+    return SIZE_MAX;
+  }
+
+  bool allocate(size_t size){
+    address = 0;
+    used = 0;
+    return writer.begin(size);
+  }
+
+  uint8_t* reserve(size_t& len){
+    if(len > PageSize + Slack - used)
+      len = PageSize + Slack - used;
+    return page + used;
+  }
+
+  uint8_t* retain(size_t& len){
+    uint8_t* dest = reserve(len);
+    writer.read(address + used, dest, len);
+    return dest;
+  }
+
+  bool commit(size_t len){
+    used += len;
+    while(used >= PageSize){
+      if(!writer.write(address, page, PageSize))
+	return false;
+      address += PageSize;
+      used -= PageSize;
+      memmove(page, page + PageSize, used);
+    }
+    return true;
+  }
+
+  bool finish(){
+    return used == 0 || writer.write(address, page, used);
+  }
+
+  void discard(){
+    writer.discard();
+  }
+};
+
+/*
+ * Decodes into one of two pages while a Writer stores the other, so
+ * that decoding overlaps with slow flash writes. The Writer provides
+ * begin(), read() and discard() as for PageStorage, and:
+ *   void write(size_t address, const uint8_t* data, size_t len)
+ *     start writing a page, data stays untouched until wait() returns
+ *   bool wait()   until the last write is done, false if it failed
+ */
+template<class Writer, size_t PageSize, size_t Slack>
+class DoubleBufferedPageStorage {
+private:
+  uint8_t pages[2][PageSize + Slack];
+  uint8_t* page = pages[0]; // being filled
+  size_t address = 0; // of the page being filled
+  size_t used = 0;
+  bool writing = false;
+
+  bool settle(){
+    bool ok = !writing || writer.wait();
+    writing = false;
+    return ok;
+  }
+
+public:
+  Writer writer;
+
+  size_t getCapacity(){
+    return SIZE_MAX;
+  }
+
+  bool allocate(size_t size){
+    settle();
+    page = pages[0];
+    address = 0;
+    used = 0;
+    return writer.begin(size);
+  }
+
+  uint8_t* reserve(size_t& len){
+    if(len > PageSize + Slack - used)
+      len = PageSize + Slack - used;
+    return page + used;
+  }
+
+  uint8_t* retain(size_t& len){
+    uint8_t* dest = reserve(len);
+    writer.read(address + used, dest, len);
+    return dest;
+  }
+
+  bool commit(size_t len){
+    used += len;
+    while(used >= PageSize){
+      uint8_t* next = page == pages[0] ? pages[1] : pages[0];
+      if(!settle()) // the other page is free once its write is done
+	return false;
+      writer.write(address, page, PageSize);
+      writing = true;
+      used -= PageSize;
+      memcpy(next, page + PageSize, used);
+      page = next;
+      address += PageSize;
+    }
+    return true;
+  }
+
+  bool finish(){
+    if(!settle())
+      return false;
+    if(used > 0){
+      writer.write(address, page, used);
+      writing = true;
+    }
+    return settle();
+  }
+
+  void discard(){
+    settle();
+    writer.discard();
+  }
+};
+
+template<class Storage>
+class BasicFirmwareLoader {
 private:
   // enum SysExFirmwareStatus {
   //   NORMAL = 0,
@@ -20,15 +281,14 @@ private:
   // };
   // SysExFirmwareStatus status = NORMAL;
 public:
+  Storage storage;
   size_t packageIndex = 0;
-  uint8_t* buffer = NULL;
   size_t size;
   size_t index;
   uint32_t crc;
   bool ready;
 public:
   void clear(){
-    buffer = NULL;
     index = 0;
     packageIndex = 0;
     ready = false;
@@ -45,6 +305,7 @@ public:
 
   int setError(const char* msg){
     error(PROGRAM_ERROR, msg);
+    storage.discard();
     clear();
     return -1;
   }
@@ -61,26 +322,15 @@ public:
     return size + sizeof(ResourceHeader);
   }
 
+  /* only for storage that keeps the data in one buffer */
   uint8_t* getData(){
-    return buffer + sizeof(ResourceHeader);
+    return storage.getData();
   }
 
   ResourceHeader* getResourceHeader(){
-    return (ResourceHeader*)buffer;
+    return storage.getResourceHeader();
   }
 
-  void allocateBuffer(size_t size){
-#ifdef USE_EXTERNAL_RAM
-    extern char _EXTRAM; // defined in link script
-    buffer = (uint8_t*)&_EXTRAM;
-#else
-    // required by devices with no ext mem
-    extern char _PATCHRAM;
-    buffer = (uint8_t*)&_PATCHRAM; 
-#endif
-    index = sizeof(ResourceHeader); // start writing data after resource header
-  }
-  
   /* decode a 32-bit unsigned integer from 5 bytes of sysex encoded data */
   uint32_t decodeInt(uint8_t *data){
     uint8_t buf[4];
@@ -104,21 +354,108 @@ public:
     size = decodeInt(data+offset);
     offset += 5; // it takes five 7-bit values to encode four bytes
     // allocate memory
-    if(size > MAX_SYSEX_PAYLOAD_SIZE)
+    if(size > storage.getCapacity())
       return setError("SysEx too big");
-    allocateBuffer(size);
+    if(!storage.allocate(size))
+      return setError("SysEx buffer not available");
+    index = sizeof(ResourceHeader); // start writing data after resource header
     packageIndex = 1;
     return 0;
   }
 
-  int32_t receiveFirmwarePackage(uint8_t* data, size_t length, size_t offset){
-    size_t len = sysex_to_data(data+offset, buffer+index, length-offset);
-    crc = crc32(buffer+index, len, crc);
+  /* decode and commit sysex encoded data */
+  int32_t decodeRun(uint8_t* data, size_t length){
+    size_t len = length - (length+7)/8; // one in eight bytes carries the high bits
+    if(getLoadedSize()+len > getDataSize())
+      return setError("Invalid SysEx size");
+    size_t room = len;
+    uint8_t* dest = storage.reserve(room);
+    if(room < len)
+      return setError("SysEx package too big");
+    sysex_to_data(data, dest, length);
+    crc = crc32(dest, len, crc);
+    if(!storage.commit(len))
+      return setError("SysEx storage write failed");
     index += len;
+    return 0;
+  }
+
+  int32_t receiveFirmwarePackage(uint8_t* data, size_t length, size_t offset){
+    return finishPackage(data+offset, length-offset);
+  }
+
+  /*
+   * An upload package may also be decoded in pieces as it arrives: once
+   * its first bytes, from the manufacturer byte on, show that it is the
+   * one expected next, its payload follows in multiples of eight bytes
+   * and then whatever is left.
+   */
+  bool isNextUploadPackage(uint8_t* data){
+    return data[2] == SYSEX_FIRMWARE_UPLOAD && packageIndex != 0 &&
+      decodeInt(data+3) == packageIndex && getLoadedSize() < getDataSize();
+  }
+
+  int32_t receivePackagePart(uint8_t* data, size_t length){
+    return decodeRun(data, length);
+  }
+
+  int32_t finishPackage(uint8_t* data, size_t length){
+    int32_t ret = decodeRun(data, length);
+    if(ret == 0)
+      packageIndex++;
+    return ret;
+  }
+
+  /* checksum and commit a run of bytes, filled with value unless retained */
+  int32_t receiveRun(size_t len, bool retain, uint8_t value){
+    while(len > 0){
+      size_t n = len;
+      uint8_t* dest = retain ? storage.retain(n) : storage.reserve(n);
+      if(dest == NULL)
+	return setError("SysEx copy not supported");
+      if(!retain)
+	memset(dest, value, n);
+      crc = crc32(dest, n, crc);
+      if(!storage.commit(n))
+	return setError("SysEx storage write failed");
+      index += n;
+      len -= n;
+    }
     packageIndex++;
     return 0;
   }
 
+  /* keep a run of bytes from the previously installed image */
+  int32_t receiveCopyPackage(uint8_t* data, size_t length, size_t offset){
+    if(length < offset+5)
+      return setError("Invalid SysEx copy package");
+    size_t len = decodeInt(data+offset);
+    if(getLoadedSize()+len > getDataSize())
+      return setError("SysEx copy out of range");
+    return receiveRun(len, true, 0);
+  }
+
+  /* expand a run of a single repeated byte */
+  int32_t receiveFillPackage(uint8_t* data, size_t length, size_t offset){
+    if(length < offset+5+5)
+      return setError("Invalid SysEx fill package");
+    size_t len = decodeInt(data+offset);
+    uint8_t value = decodeInt(data+offset+5);
+    if(getLoadedSize()+len > getDataSize())
+      return setError("SysEx fill out of range");
+    return receiveRun(len, false, value);
+  }
+
+  /* skip ahead to the next populated segment, the gap reads as erased flash */
+  int32_t receiveOffsetPackage(uint8_t* data, size_t length, size_t offset){
+    if(length < offset+5)
+      return setError("Invalid SysEx offset package");
+    size_t next = decodeInt(data+offset);
+    if(next < getLoadedSize() || next > getDataSize())
+      return setError("SysEx offset out of range");
+    return receiveRun(next - getLoadedSize(), false, 0xff);
+  }
+
   int32_t finishFirmwareUpload(uint8_t* data, size_t length, size_t offset){
     // last package: package index and checksum
     // check crc
@@ -129,6 +466,8 @@ public:
     uint32_t checksum = decodeInt(data+offset);
     if(crc != checksum)
       return setError("Invalid SysEx checksum");
+    if(!storage.finish())
+      return setError("SysEx storage write failed");
     ready = true;
     return index;
   }
@@ -141,6 +480,12 @@ public:
       return beginFirmwareUpload(data, length, offset); // first package
     else if(packageIndex != idx)
       return setError("SysEx package out of sequence"); // out of sequence package
+    else if(getLoadedSize() < getDataSize() && data[2] == SYSEX_FIRMWARE_COPY)
+      return receiveCopyPackage(data, length, offset); // unchanged blocks
+    else if(getLoadedSize() < getDataSize() && data[2] == SYSEX_FIRMWARE_FILL)
+      return receiveFillPackage(data, length, offset); // padding
+    else if(getLoadedSize() < getDataSize() && data[2] == SYSEX_FIRMWARE_OFFSET)
+      return receiveOffsetPackage(data, length, offset); // next segment
     else if(getLoadedSize() < getDataSize())
       return receiveFirmwarePackage(data, length, offset); // mid transfer package
     else if(getLoadedSize() == getDataSize())
@@ -150,4 +495,95 @@ public:
   }
 };
 
+/*
+ * Tolerates packages delivered slightly out of order, as transports
+ * that multiplex or retry may do. Packages up to Window ahead of the
+ * next expected one are held, as long as they fit in PackageSize
+ * bytes, and handed on in order once the gap is filled. Packages that
+ * were already received are ignored.
+ */
+template<class Storage, size_t Window, size_t PackageSize>
+class ReorderingFirmwareLoader : public BasicFirmwareLoader<Storage> {
+private:
+  uint8_t held[Window][PackageSize];
+  size_t heldLength[Window];
+  uint32_t received[(Window+31)/32]; // bitmap of held slots
+  size_t reordered = 0;
+  size_t duplicates = 0;
+
+  bool isHeld(size_t slot){
+    return received[slot/32] & (1UL << (slot%32));
+  }
+
+  void setHeld(size_t slot, bool on){
+    if(on)
+      received[slot/32] |= (1UL << (slot%32));
+    else
+      received[slot/32] &= ~(1UL << (slot%32));
+  }
+
+public:
+  ReorderingFirmwareLoader(){
+    memset(received, 0, sizeof(received));
+  }
+
+  /* packages that arrived early and were held */
+  size_t getReordered(){
+    return reordered;
+  }
+
+  size_t getDuplicates(){
+    return duplicates;
+  }
+
+  int32_t handleFirmwareUpload(uint8_t* data, size_t length){
+    size_t idx = this->decodeInt(data+3);
+    size_t next = this->packageIndex;
+    if(idx == 0){
+      memset(received, 0, sizeof(received));
+      reordered = 0;
+      duplicates = 0;
+    }else if(next != 0 && idx < next){
+      duplicates++;
+      return 0;
+    }else if(next != 0 && idx > next && idx <= next+Window && length <= PackageSize){
+      size_t slot = idx % Window;
+      if(isHeld(slot)){
+	duplicates++;
+	return 0;
+      }
+      memcpy(held[slot], data, length);
+      heldLength[slot] = length;
+      setHeld(slot, true);
+      reordered++;
+      return 0;
+    }
+    return drain(BasicFirmwareLoader<Storage>::handleFirmwareUpload(data, length));
+  }
+
+  int32_t finishPackage(uint8_t* data, size_t length){
+    return drain(BasicFirmwareLoader<Storage>::finishPackage(data, length));
+  }
+
+  /* hand on held packages that now follow in sequence */
+  int32_t drain(int32_t ret){
+    while(ret == 0 && this->packageIndex != 0 && isHeld(this->packageIndex % Window)){
+      size_t slot = this->packageIndex % Window;
+      setHeld(slot, false);
+      ret = BasicFirmwareLoader<Storage>::handleFirmwareUpload(held[slot], heldLength[slot]);
+    }
+    if(ret != 0)
+      memset(received, 0, sizeof(received));
+    return ret;
+  }
+};
+
+/*
+ * The device loader. Device code that used the former public buffer
+ * member reads getResourceHeader() or getData() instead, and
+ * allocateBuffer() is now done by storage.allocate() when an upload
+ * begins.
+ */
+typedef BasicFirmwareLoader<DeviceStorage> FirmwareLoader;
+
 #endif // __FirmwareLoader_H__
@@ -1,7 +1,6 @@
 /*
   g++ -g -o FirmwareReceiver -std=c++11 -ISource -IJuceLibraryCode Source/FirmwareReceiver.cpp Source/sysex.c Source/crc32.c JuceLibraryCode/modules/juce_core/juce_core.cpp JuceLibraryCode/modules/juce_audio_basics/juce_audio_basics.cpp JuceLibraryCode/modules/juce_audio_devices/juce_audio_devices.cpp JuceLibraryCode/modules/juce_events/juce_events.cpp -lpthread -ldl -lX11 -lasound
 */
-#include <unistd.h>
 #include <stdint.h>
 #include <math.h>
 #include "JuceHeader.h"
@@ -9,6 +8,14 @@
 #include "crc32.h"
 #include "sysex.h"
 #include "MidiStatus.h"
+#include "SysExForwarder.hpp"
+#include <signal.h>
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#endif
 
 #define MAX_SYSEX_PAYLOAD_SIZE (8*1024*1024)
 #define NO_ERROR         0x00
@@ -35,17 +42,20 @@ void setErrorStatus(int8_t err){
   errorcode = err;
 }
 
-#define USE_EXTERNAL_RAM
-#define _EXTRAM rx_buffer
 #define MAX_SYSEX_FIRMWARE_SIZE (80*1024)
 
-#include "FirmwareLoader.hpp"
+#include "ResourceHeader.h"
 
-uint8_t rx_buffer[8*1024*1024];
+#include "LoaderStorage.hpp"
 
 #define MESSAGE_SIZE 8
 #define DEFAULT_BLOCK_SIZE (248-MESSAGE_SIZE)
+#define DEFAULT_SYSEX_BUFFER_SIZE 1024 // largest SysEx message we report we can take
 #define DEFAULT_BLOCK_DELAY 20 // wait in milliseconds between sysex messages
+#define DEFAULT_PART_BUFFERS 1 // parts we can hold while earlier ones are stored
+#define DEFAULT_QUEUE_SIZE 256 // kilobytes of incoming MIDI held for the worker
+#define REORDER_WINDOW 16 // packages that may arrive ahead of their turn
+#define REORDER_PACKAGE_SIZE 4096 // largest package that can be held
 
 bool quiet = false;
 
@@ -62,53 +72,724 @@ public:
   }
 };
 
-class FirmwareReceiver : public juce::MidiInputCallback {
+/*
+ * Wakes the main thread from other threads, or from a signal handler:
+ * notify() only writes a byte to a pipe, which is async-signal-safe.
+ */
+#ifndef _WIN32
+class Wakeup {
+private:
+  int fds[2];
+public:
+  Wakeup(){
+    if(pipe(fds) != 0){
+      fds[0] = fds[1] = -1;
+      return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK); // a full pipe wakes the reader anyway
+  }
+
+  ~Wakeup(){
+    ::close(fds[0]);
+    ::close(fds[1]);
+  }
+
+  void notify(){
+    char c = 0;
+    if(write(fds[1], &c, 1) < 0)
+      return;
+  }
+
+  /* false if timeout milliseconds pass first, -1 to wait forever */
+  bool wait(int timeout){
+    struct pollfd pfd = { fds[0], POLLIN, 0 };
+    int ret = poll(&pfd, 1, timeout);
+    if(ret == 0 || (ret < 0 && errno != EINTR)) // a signal counts as a wakeup
+      return false;
+    char buf[64];
+    while(read(fds[0], buf, sizeof(buf)) > 0);
+    return true;
+  }
+};
+#else
+class Wakeup {
 private:
-  bool running = false;
+  juce::WaitableEvent event;
+public:
+  void notify(){
+    event.signal();
+  }
+
+  bool wait(int timeout){
+    return event.wait(timeout);
+  }
+};
+#endif
+
+volatile sig_atomic_t interrupted = 0; // set on SIGINT
+
+/*
+ * Stands in for device flash: stored parts queue up and are written out
+ * one at a time, each taking as long as the simulated flash write.
+ */
+class FlashSimulator : public juce::Thread {
+public:
+  class Listener {
+  public:
+    virtual ~Listener() {}
+    virtual void partStored(uint32_t slot, uint8_t device) = 0;
+  };
+private:
+  juce::CriticalSection lock;
+  juce::OwnedArray<juce::MemoryBlock> queue;
+  juce::Array<uint32_t> slots;
+  juce::Array<uint8_t> devices; // that asked for each store
+  juce::WaitableEvent queued;
+  OutputStream& out;
+  Listener& listener;
+  int latency; // milliseconds per kilobyte
+public:
+  FlashSimulator(OutputStream& o, Listener& l, int ms)
+    : juce::Thread("FlashSimulator"), out(o), listener(l), latency(ms) {}
+
+  ~FlashSimulator(){
+    stopThread(-1);
+  }
+
+  /* parts received but not yet written, including the one being written */
+  int getPending(){
+    const ScopedLock sl(lock);
+    return queue.size();
+  }
+
+  void store(const uint8_t* data, size_t size, uint32_t slot, uint8_t device){
+    {
+      const ScopedLock sl(lock);
+      queue.add(new juce::MemoryBlock(data, size));
+      slots.add(slot);
+      devices.add(device);
+    }
+    queued.signal();
+  }
+
+  void run(){
+    while(!threadShouldExit()){
+      juce::MemoryBlock* part;
+      uint32_t slot;
+      uint8_t device;
+      {
+	const ScopedLock sl(lock);
+	part = queue.getFirst();
+	slot = slots.getFirst();
+	device = devices.getFirst();
+      }
+      if(part == NULL){
+	queued.wait(100);
+	continue;
+      }
+      wait(latency * (int)((part->getSize()+1023)/1024));
+      out.write(part->getData(), part->getSize());
+      out.flush();
+      {
+	const ScopedLock sl(lock);
+	queue.remove(0);
+	slots.remove(0);
+	devices.remove(0);
+      }
+      listener.partStored(slot, device);
+    }
+  }
+};
+
+/*
+ * Hands incoming MIDI from the input threads to a worker that never
+ * blocks them. Messages are copied into a single consumer ring as a
+ * length, input port and kind followed by the bytes, and passed on from
+ * the worker thread. Inputs on separate threads take turns to push.
+ * SysEx may be pushed in pieces as it arrives, each with only its new
+ * bytes.
+ */
+class MidiQueue : public juce::Thread {
+public:
+  class Listener {
+  public:
+    virtual ~Listener() {}
+    virtual void handleQueuedMessage(int port, const juce::MidiMessage& message) = 0;
+    virtual void handleQueuedSysEx(int port, int kind, const uint8_t* data, int size) = 0;
+  };
+  enum Kind {
+    MESSAGE = 0,
+    SYSEX_BEGIN, // from the F0 on
+    SYSEX_MORE,
+    SYSEX_END, // up to the F7
+    SYSEX_ABORT // no more of it will come
+  };
+private:
+  struct Header {
+    int size;
+    int port;
+    int kind;
+  };
+  juce::AbstractFifo fifo;
+  juce::SpinLock producer;
+  juce::HeapBlock<uint8_t> ring;
+  juce::WaitableEvent queued;
+  Listener& listener;
+  juce::Atomic<int> highWater;
+  juce::Atomic<int> dropped;
+
+  /* copy to or from the ring starting at pos, wrapping around its end */
+  void copyIn(int pos, const void* data, int size){
+    int first = std::min(size, getCapacity()-pos);
+    memcpy(ring+pos, data, first);
+    memcpy(ring, (const uint8_t*)data+first, size-first);
+  }
+
+  void copyOut(int pos, void* data, int size){
+    int first = std::min(size, getCapacity()-pos);
+    memcpy(data, ring+pos, first);
+    memcpy((uint8_t*)data+first, ring, size-first);
+  }
+
+public:
+  MidiQueue(int capacity, Listener& l)
+    : juce::Thread("MidiQueue"), fifo(capacity), ring(capacity), listener(l) {}
+
+  ~MidiQueue(){
+    stopThread(-1);
+  }
+
+  int getCapacity() const {
+    return fifo.getTotalSize();
+  }
+
+  /* most bytes queued at once */
+  int getHighWater() const {
+    return highWater.get();
+  }
+
+  /* messages and pieces lost because the ring was full */
+  int getDropped() const {
+    return dropped.get();
+  }
+
+  /* called on a MIDI input thread, false if the ring was full */
+  bool push(int port, int kind, const uint8_t* data, int size){
+    Header header = { size, port, kind };
+    int total = sizeof(header) + header.size;
+    const juce::SpinLock::ScopedLockType sl(producer);
+    if(fifo.getFreeSpace() < total){
+      ++dropped;
+      return false;
+    }
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(total, start1, size1, start2, size2);
+    copyIn(start1, &header, sizeof(header));
+    copyIn((start1+sizeof(header)) % getCapacity(), data, header.size);
+    fifo.finishedWrite(total); // header and bytes become visible together
+    if(fifo.getNumReady() > highWater.get())
+      highWater = fifo.getNumReady();
+    queued.signal();
+    return true;
+  }
+
+  bool push(int port, const juce::MidiMessage& message){
+    return push(port, MESSAGE, message.getRawData(), message.getRawDataSize());
+  }
+
+  void run(){
+    juce::MemoryBlock message;
+    while(!threadShouldExit()){
+      Header header;
+      if(fifo.getNumReady() < (int)sizeof(header)){
+	queued.wait(100);
+	continue;
+      }
+      int start1, size1, start2, size2;
+      fifo.prepareToRead(sizeof(header), start1, size1, start2, size2);
+      copyOut(start1, &header, sizeof(header));
+      message.ensureSize(header.size);
+      copyOut((start1+sizeof(header)) % getCapacity(), message.getData(), header.size);
+      fifo.finishedRead(sizeof(header) + header.size);
+      if(header.kind == MESSAGE)
+	listener.handleQueuedMessage(header.port, juce::MidiMessage(message.getData(), header.size));
+      else
+	listener.handleQueuedSysEx(header.port, header.kind, (const uint8_t*)message.getData(), header.size);
+    }
+  }
+};
+
+/* loaders that put packages back in order, whatever their storage */
+template<class Storage>
+using ReceiveLoader = ReorderingFirmwareLoader<Storage, REORDER_WINDOW, REORDER_PACKAGE_SIZE>;
+
+/* one sender's uploads, keyed by the input port and SysEx device byte they arrive with */
+class ReceiveSession {
+public:
+  const int port;
+  const uint8_t device;
+  int uploads = 0;
+  bool active = false; // an upload has begun and not yet ended
+  ReceiveLoader<RamStorage> loader;
+
+  ReceiveSession(int p, uint8_t d) : port(p), device(d) {
+    loader.clear();
+  }
+
+  static int getKey(int port, uint8_t device){
+    return (port << 8) | device;
+  }
+
+  juce::String getName() const {
+    return juce::String(port) + ":" + juce::String::toHexString(device);
+  }
+
+  /* FILE-PORT-DEVICE.ext, numbered from the second upload on */
+  juce::File getFile(const juce::File& file) const {
+    juce::String name = file.getFileNameWithoutExtension() + "-" + juce::String(port) + "-" + juce::String::toHexString(device);
+    if(uploads > 1)
+      name << "-" << uploads;
+    return file.getSiblingFile(name + file.getFileExtension());
+  }
+};
+
+/*
+ * A SysEx message from one input port arriving in pieces. Once its
+ * header is in, an upload package the loader expects next is decoded
+ * as it comes, eight bytes at a time, and anything else is collected
+ * whole. Only the header, the piece at hand and up to seven undecoded
+ * bytes are kept.
+ */
+struct PartialSysEx {
+  juce::MemoryBlock data; // from the F0 on
+  size_t size = 0;
+  bool checked = false; // the header has been looked at
+  bool streaming = false; // being decoded as it comes
+  bool failed = false; // the loader gave up on it, drop the rest
+
+  void reset(){
+    size = 0;
+    checked = false;
+    streaming = false;
+    failed = false;
+  }
+
+  void append(const uint8_t* bytes, size_t len){
+    data.ensureSize(size+len);
+    memcpy((uint8_t*)data.getData()+size, bytes, len);
+    size += len;
+  }
+
+  /* without the F0 */
+  uint8_t* getMessage(){
+    return (uint8_t*)data.getData()+1;
+  }
+};
+
+/* what to do with an upload package, whichever loader takes it */
+struct WholePackage {
+  uint8_t* data;
+  size_t size;
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    return rx.handleFirmwareUpload(data, size);
+  }
+};
+
+struct NextPackage {
+  uint8_t* data;
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    return rx.isNextUploadPackage(data);
+  }
+};
+
+struct PackagePart {
+  uint8_t* data;
+  size_t size;
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    return rx.receivePackagePart(data, size);
+  }
+};
+
+struct PackageEnd {
+  uint8_t* data;
+  size_t size;
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    return rx.finishPackage(data, size);
+  }
+};
+
+struct PackageAbort {
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    return rx.setError("SysEx message interrupted");
+  }
+};
+
+struct UploadStats {
+  bool verbose;
+  template<class Loader>
+  int32_t operator()(Loader& rx){
+    if(verbose)
+      std::cout << "crc32: 0x" << std::hex << rx.getChecksum() << std::dec << std::endl;
+    if(verbose || rx.getReordered() > 0)
+      std::cout << rx.getReordered() << " packages reordered, "
+		<< rx.getDuplicates() << " duplicates ignored" << std::endl;
+    return 0;
+  }
+};
+
+class FirmwareReceiver : public juce::MidiInputCallback, public FlashSimulator::Listener, public MidiQueue::Listener {
+protected:
+  juce::Atomic<int> running;
+  Wakeup finished;
+  juce::Atomic<juce::uint32> lastActivity; // millisecond counter at the last incoming message
+  int idleTimeout = 0; // seconds without MIDI before giving up, 0 to wait forever
   bool verbose = false;
-  juce::ScopedPointer<MidiInput> midiin;
+  juce::OwnedArray<MidiInput> inputs; // port numbers are indices
+  juce::OwnedArray<SysExForwarder<MidiQueue> > forwarders; // by port, on the MIDI input threads
+  juce::OwnedArray<PartialSysEx> partials; // by port, on the worker thread
+  juce::ScopedPointer<File> filein; // SysEx file to replay instead
+  juce::ScopedPointer<MidiOutput> midiout;
+  uint8_t deviceNum = MIDI_SYSEX_OWL_DEVICE; // replies to omni and capability requests
+  uint32_t sysexBufferSize = DEFAULT_SYSEX_BUFFER_SIZE;
+  uint32_t partBuffers = DEFAULT_PART_BUFFERS;
+  int flashLatency = -1; // simulate storing parts when set
+  juce::ScopedPointer<FlashSimulator> flash;
+  juce::ScopedPointer<MidiQueue> queue;
+  int queueSize = DEFAULT_QUEUE_SIZE*1024;
   juce::ScopedPointer<File> fileout;
   juce::ScopedPointer<OutputStream> out;
-  FirmwareLoader loader;
+  juce::File base;
+  bool streaming = false;
+  juce::ScopedPointer<ReceiveLoader<FileStreamStorage> > streamer;
+  bool mapping = false;
+  juce::ScopedPointer<ReceiveLoader<MappedFileStorage> > mapped;
+  int programLatency = -1; // emulate flash when either is set
+  int eraseLatency = -1;
+  juce::ScopedPointer<ReceiveLoader<FlashEmulatorStorage> > emulated;
+  ReceiveLoader<RamStorage> loader;
+  bool multiSession = false;
+  bool keepReceiving = false;
+  juce::OwnedArray<ReceiveSession> sessions;
+  juce::HashMap<int, ReceiveSession*> sessionMap;
+  juce::MemoryBlock baseImage;
 public:
   void listDevices(const StringArray& names){
     for(int i=0; i<names.size(); ++i)
       std::cout << i << ": " << names[i] << std::endl;
   }
 
+  /* on the MIDI input thread: only queue the message, or the rest of a SysEx under way, for the worker */
   void handleIncomingMidiMessage(MidiInput *source, const MidiMessage &message){
+    lastActivity = juce::Time::getMillisecondCounter();
+    int port = std::max(0, inputs.indexOf(source));
+    forwarders[port]->handleMessage(message);
+  }
+
+  /* on the MIDI input thread: queue what is new of a SysEx under way */
+  void handlePartialSysexMessage(MidiInput *source, const uint8 *messageData, int numBytesSoFar, double timestamp){
+    lastActivity = juce::Time::getMillisecondCounter();
+    int port = std::max(0, inputs.indexOf(source));
+    forwarders[port]->handlePartial(messageData, numBytesSoFar);
+  }
+
+  void handleQueuedMessage(int port, const MidiMessage &message){
     // if(verbose)
     //   std::cout << "rx message " << message.getRawDataSize() << " bytes." << std::endl;
-    uint8_t* data = (uint8_t*)message.getRawData();
-    uint16_t size = message.getRawDataSize();
-    data += 1;
-    size -= 2;
+    if(message.isControllerOfType(REQUEST_SETTINGS)){
+      if(message.getControllerValue() == SYSEX_DEVICE_CAPABILITIES)
+	sendCapabilities();
+      return;
+    }
+    if(message.isSysEx())
+      handleSysEx(port, (uint8_t*)message.getRawData()+1, message.getRawDataSize()-2);
+  }
+
+  PartialSysEx& getPartial(int port){
+    while(partials.size() <= port)
+      partials.add(new PartialSysEx());
+    return *partials[port];
+  }
+
+  /* a piece of a SysEx message, decoded as it comes if it is the next upload package */
+  void handleQueuedSysEx(int port, int kind, const uint8_t* bytes, int len){
+    PartialSysEx& part = getPartial(port);
+    if(kind == MidiQueue::SYSEX_BEGIN || kind == MidiQueue::SYSEX_ABORT){
+      if(part.streaming){
+	uint8_t device = part.getMessage()[1];
+	PackageAbort op;
+	received(port, device, false, applyLoader(port, device, op));
+      }
+      part.reset();
+      if(kind == MidiQueue::SYSEX_ABORT)
+	return;
+    }
+    bool last = kind == MidiQueue::SYSEX_END;
+    if(part.failed){
+      if(last)
+	part.reset();
+      return;
+    }
+    part.append(bytes, last ? len-1 : len); // without the F7
+    uint8_t* message = part.getMessage();
+    const size_t header = 1+MESSAGE_SIZE; // F0, manufacturer, device, command and index
+    if(!part.checked && !last && part.size >= header){
+      part.checked = true;
+      if(message[0] == MIDI_SYSEX_MANUFACTURER && message[2] == SYSEX_FIRMWARE_UPLOAD){
+	NextPackage op = { message };
+	part.streaming = applyLoader(port, message[1], op);
+      }
+    }
+    if(part.streaming){
+      uint8_t* payload = message+MESSAGE_SIZE;
+      size_t pending = part.size - header;
+      size_t decoded = last ? pending : pending/8*8; // whole groups of seven bytes and their high bits
+      int32_t ret = 0;
+      if(last){
+	PackageEnd op = { payload, pending };
+	ret = applyLoader(port, message[1], op);
+      }else if(decoded > 0){
+	PackagePart op = { payload, decoded };
+	ret = applyLoader(port, message[1], op);
+      }
+      if(last || ret != 0)
+	received(port, message[1], false, ret);
+      if(ret < 0){
+	part.streaming = false;
+	part.failed = true;
+      }
+      memmove(payload, payload+decoded, pending-decoded);
+      part.size -= decoded;
+    }
+    if(last){
+      if(!part.streaming && !part.failed)
+	handleSysEx(port, message, part.size-1);
+      part.reset();
+    }
+  }
+
+  /* a SysEx message without its F0 and F7 */
+  void handleSysEx(int port, uint8_t* data, size_t size){
     if(size > 3 && 
        data[0] == MIDI_SYSEX_MANUFACTURER || 
        data[1] == MIDI_SYSEX_OWL_DEVICE) {
-      if(data[2] == SYSEX_FIRMWARE_UPLOAD){
-	
-	int32_t ret = loader.handleFirmwareUpload(data, size);
-	if(ret < 0){
-	  std::cerr << "receive error: " << ret << std::endl;
-	}else if(ret > 0){
-	  std::cout << "receive complete: " << ret << " bytes. " << std::endl;
-	  out->write(loader.getData(), loader.getDataSize());
-	  out->flush();
-	  if(verbose)
-	    std::cout << "crc32: 0x" << std::hex << loader.getChecksum() << std::endl;
-	  shutdown();
-	}else{
-	  std::cout << '.';
-	}
+      if(data[2] == SYSEX_DEVICE_ECHO && size >= 3+5){
+	sendEcho(data[1], data+3);
+      }else if(data[2] == SYSEX_FIRMWARE_STORE && size >= 3+5){
+	storePart(data[1], loader.decodeInt(data+3));
+      }else if(data[2] == SYSEX_FIRMWARE_UPLOAD || data[2] == SYSEX_FIRMWARE_COPY ||
+	 data[2] == SYSEX_FIRMWARE_FILL || data[2] == SYSEX_FIRMWARE_OFFSET){
+	bool first = loader.decodeInt(data+3) == 0;
+	if(!multiSession && flash != NULL && data[2] == SYSEX_FIRMWARE_UPLOAD && first &&
+	   flash->getPending() >= (int)partBuffers)
+	  std::cerr << "receive error: no free part buffer" << std::endl;
+	WholePackage op = { data, size };
+	received(port, data[1], first, applyLoader(port, data[1], op));
       }
     }else{
       std::cout << "rx unknown or invalid SysEx message" << std::endl;
     }
   }
 
-  void handlePartialSysexMessage(MidiInput *source, const uint8 *messageData, int numBytesSoFar, double timestamp){
-    std::cout << "rx partial sysex " << numBytesSoFar << " bytes." << std::endl;
+  /* hand op the loader for an upload from port and device, with any of the storage the loaders use */
+  template<class Op>
+  int32_t applyLoader(int port, uint8_t device, Op& op){
+    if(multiSession)
+      return op(getSession(port, device)->loader);
+    else if(streamer != NULL)
+      return op(*streamer);
+    else if(mapped != NULL)
+      return op(*mapped);
+    else if(emulated != NULL)
+      return op(*emulated);
+    else
+      return op(loader);
+  }
+
+  /* report on an upload package, whole or at its end, and save the upload once complete */
+  void received(int port, uint8_t device, bool first, int32_t ret){
+    if(multiSession){
+      receivedSession(getSession(port, device), first, ret);
+    }else if(ret < 0){
+      std::cerr << "receive error: " << ret << std::endl;
+    }else if(ret > 0){
+      std::cout << "receive complete: " << ret << " bytes. " << std::endl;
+      UploadStats stats = { verbose };
+      applyLoader(port, device, stats);
+      if(streamer != NULL || mapped != NULL || emulated != NULL){
+	shutdown();
+      }else if(flash == NULL){
+	out->write(loader.getData(), loader.getDataSize());
+	out->flush();
+	shutdown();
+      }
+    }else if(!quiet){
+      std::cout << '.';
+    }
+  }
+
+  ReceiveSession* getSession(int port, uint8_t device){
+    int key = ReceiveSession::getKey(port, device);
+    ReceiveSession* session = sessionMap[key];
+    if(session == NULL){
+      session = sessions.add(new ReceiveSession(port, device));
+      session->loader.storage.setBase(baseImage.getData(), baseImage.getSize());
+      sessionMap.set(key, session);
+    }
+    return session;
+  }
+
+  /* the same for the session of its port and device */
+  void receivedSession(ReceiveSession* session, bool first, int32_t ret){
+    if(ret < 0){
+      session->active = false;
+      std::cerr << session->getName() << " receive error: " << ret << std::endl;
+    }else if(ret == 0 && first){
+      session->active = true;
+      if(!quiet)
+	std::cout << session->getName() << " receiving " << session->loader.getDataSize() << " bytes" << std::endl;
+    }else if(ret > 0){
+      session->active = false;
+      session->uploads++;
+      juce::File file = session->getFile(*fileout);
+      if(!file.replaceWithData(session->loader.getData(), session->loader.getDataSize()))
+	std::cerr << session->getName() << " cannot write " << file.getFullPathName() << std::endl;
+      else if(!quiet)
+	std::cout << session->getName() << " receive complete: " << ret << " bytes to " << file.getFileName() << std::endl;
+      if(!keepReceiving && !isReceiving())
+	shutdown();
+    }
+  }
+
+  /* true while any session has an upload under way */
+  bool isReceiving(){
+    for(int i=0; i<sessions.size(); ++i)
+      if(sessions[i]->active)
+	return true;
+    return false;
+  }
+
+  /* feed every F0 to F7 frame of a SysEx file to the loaders, as fast as they take them */
+  void replay(const File& file){
+    juce::MemoryMappedFile map(file, juce::MemoryMappedFile::readOnly);
+    if(map.getData() == NULL)
+      throw CommandLineException("Cannot map " + file.getFullPathName());
+    const uint8_t* begin = (const uint8_t*)map.getData();
+    const uint8_t* end = begin + map.getSize();
+    const uint8_t* p = begin;
+    int frames = 0;
+    double start = juce::Time::getMillisecondCounterHiRes();
+    // a single upload ends at its checksum, sessions and stored parts read to the end
+    while(p < end && (running.get() || multiSession || flash != NULL)){
+      const uint8_t* f0 = (const uint8_t*)memchr(p, SYSEX, end-p);
+      if(f0 == NULL)
+	break;
+      const uint8_t* f7 = (const uint8_t*)memchr(f0, SYSEX_EOX, end-f0);
+      if(f7 == NULL){
+	std::cerr << "truncated SysEx frame at offset " << (f0-begin) << std::endl;
+	break;
+      }
+      handleSysEx(0, (uint8_t*)f0+1, f7-f0-1);
+      frames++;
+      p = f7+1;
+    }
+    double ms = juce::Time::getMillisecondCounterHiRes() - start;
+    if(!quiet){
+      std::cout << std::endl << "replayed " << frames << " SysEx frames, " << (p-begin) << " bytes in "
+		<< juce::String(ms, 1) << " ms";
+      if(ms > 0) // a small file can replay within the timer's resolution
+	std::cout << " (" << juce::String((p-begin)/ms/1000, 2) << " MB/s)";
+      std::cout << std::endl;
+    }
+    while(flash != NULL && flash->getPending() > 0)
+      juce::Thread::sleep(10);
+    if(multiSession ? isReceiving() : (running.get() && flash == NULL))
+      throw CommandLineException("SysEx file ended before the upload completed");
+  }
+
+  void loadBase(const File& file){
+    if(file.getSize() > MAX_SYSEX_PAYLOAD_SIZE)
+      throw CommandLineException("Base image too big: "+file.getFullPathName());
+    juce::MemoryBlock data;
+    if(!file.loadFileAsData(data))
+      throw CommandLineException("Cannot read "+file.getFullPathName());
+    loader.storage.setBase(data.getData(), data.getSize());
+    baseImage = data;
+    if(verbose)
+      std::cout << "loaded base image " << file.getFileName() << ": " << file.getSize() << " bytes" << std::endl;
+  }
+
+  /* hand a completely received part to the flash, freeing the loader for the next */
+  void storePart(uint8_t device, uint32_t slot){
+    if(flash == NULL)
+      return; // without -w the upload is saved as it completes
+    if(!loader.isReady()){
+      std::cerr << "receive error: nothing to store" << std::endl;
+      return;
+    }
+    if(!quiet)
+      std::cout << "storing " << loader.getDataSize() << " bytes in slot " << slot << std::endl;
+    flash->store(loader.getData(), loader.getDataSize(), slot, device);
+    loader.clear();
+  }
+
+  /* acknowledge a finished flash write so the sender may reuse the buffer */
+  void partStored(uint32_t slot, uint8_t device){
+    if(verbose)
+      std::cout << "stored slot " << slot << std::endl;
+    MemoryBlock block = createReply(device, SYSEX_FIRMWARE_STORE);
+    encodeInt(block, slot);
+    sendReply(block);
+  }
+
+  /* requested by a controller change, which names no device */
+  void sendCapabilities(){
+    if(verbose)
+      std::cout << "reporting SysEx buffer of " << sysexBufferSize << " bytes, "
+		<< partBuffers << " part buffers" << std::endl;
+    MemoryBlock block = createReply(deviceNum, SYSEX_DEVICE_CAPABILITIES);
+    encodeInt(block, sysexBufferSize);
+    encodeInt(block, partBuffers);
+    sendReply(block);
+  }
+
+  /* answer a calibration probe with its index */
+  void sendEcho(uint8_t device, uint8_t* index){
+    MemoryBlock block = createReply(device, SYSEX_DEVICE_ECHO);
+    block.append(index, 5);
+    sendReply(block);
+  }
+
+  /* reply as the device we were addressed as, senders ignore other devices */
+  MemoryBlock createReply(uint8_t device, uint8_t command){
+    if(device == MIDI_SYSEX_OMNI_DEVICE)
+      device = deviceNum;
+    const uint8_t header[] =  { MIDI_SYSEX_MANUFACTURER, device, command };
+    return MemoryBlock(header, sizeof(header));
+  }
+
+  virtual void sendReply(const MemoryBlock& block){
+    if(midiout != NULL)
+      midiout->sendMessageNow(juce::MidiMessage::createSysExMessage(block.getData(), block.getSize()));
+  }
+
+  MidiOutput* openMidiOutput(const String& name){
+    MidiOutput* output = NULL;
+    StringArray outputs = MidiOutput::getDevices();
+    for(int i=0; i<outputs.size(); ++i){
+      if(outputs[i].trim().matchesWildcard(name, true)){
+	if(verbose)
+	  std::cout << "opening MIDI output " << outputs[i] << std::endl;
+	output = MidiOutput::openDevice(i);
+	break;
+      }
+    }
+    return output;
   }
 
   MidiInput* openMidiInput(const String& name){
@@ -130,9 +811,29 @@ public:
 	      << "usage:" << std::endl
 	      << "-h or --help\tprint this usage information and exit" << std::endl
 	      << "-l or --list\tlist available MIDI ports and exit" << std::endl
-	      << "-in DEVICE\tconnect to MIDI input DEVICE" << std::endl
-	      << "-c DEVICE\tcreate MIDI input DEVICE" << std::endl
+	      << "-in DEVICE\tconnect to MIDI input DEVICE, more than once with -sessions" << std::endl
+	      << "-in FILE\treplay the SysEx messages in FILE as fast as they decode" << std::endl
+	      << "-out DEVICE\tsend replies to MIDI output DEVICE" << std::endl
+	      << "-c DEVICE\tcreate MIDI input and output DEVICE" << std::endl
+	      << "-s NUM\t\treport a SysEx buffer of NUM bytes" << std::endl
+	      << "-b NUM\t\treport NUM part buffers for pipelined uploads" << std::endl
+	      << "-id NUM\t\treply as device NUM to omni and capability requests" << std::endl
+	      << "-w NUM\t\tstore parts in simulated flash taking NUM ms per kilobyte,\n"
+	      << "\t\tand keep receiving until interrupted" << std::endl
+	      << "-t NUM\t\tstop after NUM seconds without incoming MIDI" << std::endl
+	      << "-r NUM\t\tqueue up to NUM kilobytes of incoming MIDI (default "
+	      << DEFAULT_QUEUE_SIZE << ")" << std::endl
 	      << "-save FILE\twrite data to FILE" << std::endl
+	      << "-base FILE\tpreload FILE as the installed image for delta uploads" << std::endl
+	      << "-stream\t\twrite data to the -save file as it arrives, with no size limit" << std::endl
+	      << "-mmap\t\tdecode straight into the -save file, mapped into memory" << std::endl
+	      << "-program NUM\twrite the -save file as emulated flash taking NUM us per "
+	      << FLASH_PAGE_SIZE/1024 << "KB page" << std::endl
+	      << "-erase NUM\twrite the -save file as emulated flash taking NUM ms per "
+	      << FLASH_SECTOR_SIZE/1024 << "KB sector" << std::endl
+	      << "-sessions\treceive concurrent uploads keyed by input and device, each\n"
+	      << "\t\tsaved to the -save file name with -PORT-DEVICE added" << std::endl
+	      << "-keep\t\tkeep receiving sessions until interrupted" << std::endl
 	      << "-q or --quiet\treduce status output" << std::endl
 	      << "-v or --verbose\tincrease status output" << std::endl
       ;
@@ -156,61 +857,213 @@ public:
 	throw CommandLineException(juce::String::empty);
       }else if(arg.compare("-in") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
-	midiin = openMidiInput(name);
+	juce::File file = File::getCurrentWorkingDirectory().getChildFile(name);
+	if(file.existsAsFile()){
+	  filein = new juce::File(file);
+	  continue;
+	}
+	MidiInput* input = openMidiInput(name);
+	if(input == NULL)
+	  throw CommandLineException("MIDI input not available: "+name);
+	inputs.add(input);
       }else if(arg.compare("-c") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
-	midiin = MidiInput::createNewDevice(name, this);
+	inputs.add(MidiInput::createNewDevice(name, this));
+	midiout = MidiOutput::createNewDevice(name);
+      }else if(arg.compare("-out") == 0 && ++i < argc){
+	juce::String name = juce::String(argv[i]);
+	midiout = openMidiOutput(name);
+      }else if(arg.compare("-s") == 0 && ++i < argc){
+	sysexBufferSize = juce::String(argv[i]).getIntValue();
+      }else if(arg.compare("-b") == 0 && ++i < argc){
+	partBuffers = std::max(1, juce::String(argv[i]).getIntValue());
+      }else if(arg.compare("-id") == 0 && ++i < argc){
+	deviceNum = juce::String(argv[i]).getIntValue() & 0x7f;
+      }else if(arg.compare("-w") == 0 && ++i < argc){
+	flashLatency = std::max(0, juce::String(argv[i]).getIntValue());
+      }else if(arg.compare("-t") == 0 && ++i < argc){
+	idleTimeout = std::max(0, juce::String(argv[i]).getIntValue());
+      }else if(arg.compare("-r") == 0 && ++i < argc){
+	queueSize = std::max(1, juce::String(argv[i]).getIntValue()) * 1024;
       }else if(arg.compare("-save") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
 	fileout = new juce::File(name);
 	fileout->deleteFile();
 	fileout->create();
+      }else if(arg.compare("-base") == 0 && ++i < argc){
+	juce::String name = juce::String(argv[i]);
+	base = File::getCurrentWorkingDirectory().getChildFile(name);
+	if(!base.exists())
+	  throw CommandLineException("No such file: "+base.getFullPathName());
+      }else if(arg.compare("-stream") == 0){
+	streaming = true;
+      }else if(arg.compare("-sessions") == 0){
+	multiSession = true;
+      }else if(arg.compare("-keep") == 0){
+	multiSession = true;
+	keepReceiving = true;
+      }else if(arg.compare("-mmap") == 0){
+	mapping = true;
+      }else if(arg.compare("-program") == 0 && ++i < argc){
+	programLatency = std::max(0, juce::String(argv[i]).getIntValue());
+      }else if(arg.compare("-erase") == 0 && ++i < argc){
+	eraseLatency = std::max(0, juce::String(argv[i]).getIntValue());
       }else{
 	usage();
 	throw CommandLineException(juce::String::empty);
       }
     }
-    if(midiin == NULL || fileout == NULL){
+    if((inputs.isEmpty() && filein == NULL) || fileout == NULL){
       usage();
       throw CommandLineException(juce::String::empty);
     }
+    if(streaming && flashLatency >= 0)
+      throw CommandLineException("-stream cannot be combined with -w");
+    if(mapping && (streaming || flashLatency >= 0))
+      throw CommandLineException("-mmap cannot be combined with -stream or -w");
+    if((programLatency >= 0 || eraseLatency >= 0) && (streaming || mapping || flashLatency >= 0))
+      throw CommandLineException("-program and -erase cannot be combined with -stream, -mmap or -w");
+    if(multiSession && (streaming || mapping || flashLatency >= 0 || programLatency >= 0 || eraseLatency >= 0))
+      throw CommandLineException("-sessions and -keep receive into memory only");
+    if(filein != NULL && !inputs.isEmpty())
+      throw CommandLineException("cannot replay a SysEx file and receive MIDI at once");
+    if(inputs.size() > 1 && !multiSession) // one loader cannot take uploads from several ports
+      throw CommandLineException("several MIDI inputs need -sessions");
   }
 
   void run(){
-    running = true;
+    start();
+    if(filein != NULL){
+      replay(*filein);
+      finish();
+      return;
+    }
+    queue = new MidiQueue(queueSize, *this);
+    queue->startThread();
+    for(int i=0; i<inputs.size(); ++i)
+      forwarders.add(new SysExForwarder<MidiQueue>(*queue, i));
+    for(int i=0; i<inputs.size(); ++i)
+      inputs[i]->start();
+    bool timedOut = waitForShutdown();
+    for(int i=0; i<inputs.size(); ++i)
+      inputs[i]->stop();
+    queue->stopThread(-1);
+    if(verbose || queue->getDropped() > 0)
+      std::cout << "MIDI queue high-water mark " << queue->getHighWater() << " of " << queue->getCapacity()
+		<< " bytes, " << queue->getDropped() << " messages dropped" << std::endl;
+    finish();
+    if(timedOut && flashLatency < 0 && !keepReceiving) // an upload that never completed
+      throw CommandLineException("receive timeout: no MIDI for " + juce::String(idleTimeout) + " seconds");
+  }
+
+  /* open the storage and start the flash, ready for messages */
+  void start(){
+    running = 1;
+    lastActivity = juce::Time::getMillisecondCounter();
     if(!quiet){
       std::cout << "Receiving to file " << fileout->getFileName() << std::endl; 
-      if(midiin != NULL)
-	std::cout << "\tfrom MIDI input" << std::endl; 
-      // if(filein != NULL)
-      // 	std::cout << "\tfrom SysEx file " << filein->getFullPathName() << std::endl;       
-    }
-    if(fileout != NULL)
-      out = fileout->createOutputStream();
-    midiin->start();
-    while(running);
+      for(int i=0; i<inputs.size(); ++i)
+	std::cout << "\tfrom MIDI input " << i << ": " << inputs[i]->getName() << std::endl;
+      if(filein != NULL)
+	std::cout << "\tfrom SysEx file " << filein->getFullPathName() << std::endl;
+    }
+    if(streaming){
+      streamer = new ReceiveLoader<FileStreamStorage>();
+      streamer->clear();
+      juce::Result result = streamer->storage.writer.open(*fileout, base);
+      if(result.failed())
+	throw CommandLineException(result.getErrorMessage());
+    }else if(mapping){
+      mapped = new ReceiveLoader<MappedFileStorage>();
+      mapped->clear();
+      juce::Result result = mapped->storage.open(*fileout, base);
+      if(result.failed())
+	throw CommandLineException(result.getErrorMessage());
+    }else if(programLatency >= 0 || eraseLatency >= 0){
+      emulated = new ReceiveLoader<FlashEmulatorStorage>();
+      emulated->clear();
+      emulated->storage.writer.setLatency(std::max(0, programLatency), std::max(0, eraseLatency));
+      juce::Result result = emulated->storage.writer.open(*fileout, base);
+      if(result.failed())
+	throw CommandLineException(result.getErrorMessage());
+    }else{
+      if(base != juce::File())
+	loadBase(base);
+      if(multiSession)
+	fileout->deleteFile(); // each session writes a file of its own
+      else
+	out = fileout->createOutputStream();
+    }
+    if(flashLatency >= 0){
+      flash = new FlashSimulator(*out, *this, flashLatency);
+      flash->startThread();
+    }
+  }
+
+  /* stop the flash and report, once no more messages come in */
+  void finish(){
+    flash = NULL;
+    if(emulated != NULL && !quiet){
+      FlashEmulator& writer = emulated->storage.writer;
+      std::cout << "flash emulator: " << writer.getPagesProgrammed() << " pages programmed, "
+		<< writer.getSectorsErased() << " sectors erased, loader waited "
+		<< juce::String(writer.getWaitTime(), 1) << " ms" << std::endl;
+    }
+    if(multiSession && !quiet){
+      int uploads = 0;
+      for(int i=0; i<sessions.size(); ++i)
+	uploads += sessions[i]->uploads;
+      std::cout << sessions.size() << " sessions, " << uploads << " uploads received" << std::endl;
+    }
     if(out != NULL)
       out->flush();
-    if(midiin != NULL)
-      midiin->stop();
   }
 
-  uint32_t decodeInt(MemoryBlock& block){
-    return 0;
-    // uint8_t in[4];
-    // uint8_t out[5];
-    // in[3] = (uint8_t)data & 0xff;
-    // in[2] = (uint8_t)(data >> 8) & 0xff;
-    // in[1] = (uint8_t)(data >> 16) & 0xff;
-    // in[0] = (uint8_t)(data >> 24) & 0xff;
-    // int len = data_to_sysex(in, out, 4);
-    // if(len != 5)
-    //   throw CommandLineException("Error in sysex conversion"); 
-    // block.append(out, len);
+  /* sleep until shutdown, or until idle for too long; true if timed out */
+  bool waitForShutdown(){
+    while(running.get()){
+      if(interrupted){
+	if(!quiet)
+	  std::cout << "shutting down" << std::endl;
+	shutdown();
+	break;
+      }
+      if(idleTimeout == 0){
+	finished.wait(-1);
+	continue;
+      }
+      int idle = juce::Time::getMillisecondCounter() - lastActivity.get();
+      if(idle >= idleTimeout*1000){
+	if(!quiet)
+	  std::cout << "no MIDI for " << idleTimeout << " seconds, stopping" << std::endl;
+	return true;
+      }
+      finished.wait(idleTimeout*1000 - idle);
+    }
+    return false;
+  }
+
+  void encodeInt(MemoryBlock& block, uint32_t data){
+    uint8_t in[4];
+    uint8_t out[5];
+    in[3] = (uint8_t)data & 0xff;
+    in[2] = (uint8_t)(data >> 8) & 0xff;
+    in[1] = (uint8_t)(data >> 16) & 0xff;
+    in[0] = (uint8_t)(data >> 24) & 0xff;
+    int len = data_to_sysex(in, out, 4);
+    if(len != 5)
+      throw CommandLineException("Error in sysex conversion"); 
+    block.append(out, len);
   }
 
   void shutdown(){
-    running = false;
+    running = 0;
+    finished.notify();
+  }
+
+  /* from the signal handler, only wakes the main thread */
+  void interrupt(){
+    finished.notify();
   }
 
   juce::String getApplicationName(){
@@ -218,14 +1071,14 @@ public:
   }
 };
 
+#ifndef FIRMWARE_RECEIVER_NO_MAIN // tests drive the receiver themselves
 FirmwareReceiver* app = NULL;
 
 #ifndef _WIN32
 void sigfun(int sig){
-  if(!quiet)
-    std::cout << "shutting down" << std::endl;
+  interrupted = 1;
   if(app != NULL)
-    app->shutdown();
+    app->interrupt();
   (void)signal(SIGINT, SIG_DFL);
 }
 #endif
@@ -246,3 +1099,4 @@ int main(int argc, char* argv[]) {
   delete app;
   return status;
 }
+#endif
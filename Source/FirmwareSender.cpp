@@ -4,19 +4,14 @@
 #ifndef _WIN32
 #include <unistd.h>
 #endif
+#include <signal.h>
 #include <stdint.h>
-#include <math.h>
 #include "JuceHeader.h"
-#include "OpenWareMidiControl.h"
-#include "crc32.h"
-#include "sysex.h"
-#include "MidiStatus.h"
+#include "UploadEngine.hpp"
+#include "UnixSocket.hpp"
 
-#define MESSAGE_SIZE 8
-#define DEFAULT_BLOCK_SIZE (248-MESSAGE_SIZE)
-#define DEFAULT_BLOCK_DELAY 20 // wait in milliseconds between sysex messages
 
-static bool quiet = false;
+#define MAX_JOB_LENGTH 4096 // longest daemon job request line
 
 class CommandLineException : public std::exception {
 private:
@@ -27,83 +22,75 @@ public:
     return cause;
   }
   const char* what() const noexcept {
-    return getCause().toUTF8();
+    return cause.toRawUTF8();
   }
 };
 
+/* one resource of a bank upload */
+struct BankItem {
+  juce::File file;
+  int slot;
+  juce::String name;
+};
+
+/* turns command line options into an upload job for the engine */
 class FirmwareSender {
 private:
-  bool running = false;
+  bool quiet = false;
   bool verbose = false;
-  juce::ScopedPointer<MidiOutput> midiout;
-  juce::ScopedPointer<File> fileout;
+  UploadJob job;
+  juce::Array<bool> hasDeviceNum; // per target, whether -id was given for it
+  juce::ScopedPointer<UploadEngine> engine;
   juce::ScopedPointer<File> input;
-  juce::ScopedPointer<OutputStream> out;
-  int blockDelay = DEFAULT_BLOCK_DELAY;
-  int blockSize = DEFAULT_BLOCK_SIZE;
+  FirmwareImage::Format inputFormat = FirmwareImage::BY_EXTENSION;
   int storeSlot = -1;
   juce::String saveName;
   bool doRun = false;
   bool doFlash = false;
   uint32_t flashChecksum;
   uint8_t deviceNum = MIDI_SYSEX_OMNI_DEVICE;
-  uint32_t partSize = 0;
-  uint32_t slotSize = 128*1024;
+  std::vector<BankItem> bank;
+  juce::String daemonPath;
+  juce::Thread* daemon = NULL;
+  juce::CriticalSection lock; // guards engine, daemon and cancelled against shutdown()
+  bool cancelled = false;
 public:
   void listDevices(const StringArray& names){
     for(int i=0; i<names.size(); ++i)
       std::cout << i << ": " << names[i] << std::endl;
   }
 
-  MidiOutput* openMidiOutput(const String& name){
-    MidiOutput* output = NULL;    
-    StringArray outputs = MidiOutput::getDevices();
-    for(int i=0; i<outputs.size(); ++i){
-      if(outputs[i].trim().matchesWildcard(name, true)){
-	if(verbose)
-	  std::cout << "opening MIDI output " << outputs[i] << std::endl;
-	output = MidiOutput::openDevice(i);
-	break;
-      }
-    }
-    if(output != NULL)
-      output->startBackgroundThread();
-    return output;
-  }
-
-  void send(MemoryBlock& block){
-    send((unsigned char*)block.getData(), block.getSize());
-  }
-
-  void send(unsigned char* data, int size){
-    if(verbose)
-      std::cout << "sending " << std::dec << size << " bytes" << std::endl;
-    if(out != NULL){
-      out->writeByte(SYSEX);
-      out->write(data, size);
-      out->writeByte(SYSEX_EOX);
-      out->flush();
-    }
-    if(midiout != NULL)
-      midiout->sendMessageNow(juce::MidiMessage::createSysExMessage(data, size));
-  }
-
   void usage(){
-    std::cerr << getApplicationName() << std::endl 
+    std::cerr << getApplicationName() << std::endl
 	      << "usage:" << std::endl
 	      << "-h or --help\tprint this usage information and exit" << std::endl
 	      << "-l or --list\tlist available MIDI ports and exit" << std::endl
-	      << "-in FILE\tinput FILE" << std::endl
-	      << "-out DEVICE\tsend output to MIDI interface DEVICE" << std::endl
-	      << "-id NUM\t\tsend to OWL device NUM" << std::endl
+	      << "-in FILE\tinput FILE, Intel HEX if named .hex or .ihex, ELF if named .elf,\n"
+	      << "\t\telse binary" << std::endl
+	      << "-hex\t\tread the -in file as Intel HEX" << std::endl
+	      << "-elf\t\tread the -in file as ELF" << std::endl
+	      << "-bank FILE\tsend every file in directory FILE, or listed in FILE\n"
+	      << "\t\tas lines of: INPUT [-store NUM] [-name NAME]" << std::endl
+	      << "-delta FILE\tonly send blocks that differ from installed image FILE" << std::endl
+	      << "-out DEVICE\tsend output to MIDI interface DEVICE, may be repeated" << std::endl
+	      << "-id NUM\t\tsend to OWL device NUM (applies to the preceding -out, repeat to\n"
+	      << "\t\tinterleave uploads to several devices on one bus)" << std::endl
 	      << "-split NUM\tsplit into parts of no more than NUM kilobytes of data" << std::endl
 	      << "-save FILE\twrite output to FILE" << std::endl
 	      << "-store NUM\tstore in slot NUM" << std::endl
+	      << "-pipeline\tsend the next -split part while the device stores the last" << std::endl
 	      << "-name NAME\tsave resource as NAME" << std::endl
+	      << "-sparse\t\tsend runs of 0x00 or 0xff as fill commands" << std::endl
 	      << "-run\t\tstart patch after upload" << std::endl
 	      << "-flash NUM\tflash firmware with checksum NUM" << std::endl
 	      << "-d NUM\t\tdelay for NUM milliseconds between blocks" << std::endl
-	      << "-s NUM\t\tlimit SysEx messages to NUM bytes" << std::endl
+	      << "-s NUM\t\tlimit SysEx messages to NUM bytes (default: ask the device)" << std::endl
+	      << "-auto\t\ttune delay and message size to the device, cached per device\n"
+	      << "\t\tunless -s or -d sets where to start" << std::endl
+	      << "-reactor\tdrive all MIDI outputs from a single thread" << std::endl
+	      << "-daemon PATH\tkeep MIDI ports open and take upload jobs, given as lines of\n"
+	      << "\t\toptions, on Unix socket PATH; jobs may only -save below the\n"
+	      << "\t\tcurrent directory" << std::endl
 	      << "-q or --quiet\treduce status output" << std::endl
 	      << "-v or --verbose\tincrease status output" << std::endl
       ;
@@ -126,200 +113,391 @@ public:
 	listDevices(MidiOutput::getDevices());
 	throw CommandLineException(juce::String::empty);
       }else if(arg.compare("-d") == 0 && ++i < argc){
-	blockDelay = juce::String(argv[i]).getIntValue();
+	job.blockDelay = juce::String(argv[i]).getIntValue();
       }else if(arg.compare("-s") == 0 && ++i < argc){
-	blockSize = juce::String(argv[i]).getIntValue() - MESSAGE_SIZE;
+	job.messageSize = juce::String(argv[i]).getIntValue();
+      }else if(arg.compare("-auto") == 0){
+	job.autoTune = true;
+      }else if(arg.compare("-reactor") == 0){
+	job.useReactor = true;
+      }else if(arg.compare("-pipeline") == 0){
+	job.pipeline = true;
       }else if(arg.compare("-store") == 0 && ++i < argc){
 	storeSlot = juce::String(argv[i]).getIntValue();
       }else if(arg.compare("-name") == 0 && ++i < argc){
 	saveName = juce::String(argv[i]);
+      }else if(arg.compare("-sparse") == 0){
+	job.sparse = true;
+      }else if(arg.compare("-hex") == 0){
+	inputFormat = FirmwareImage::INTEL_HEX;
+      }else if(arg.compare("-elf") == 0){
+	inputFormat = FirmwareImage::ELF;
       }else if(arg.compare("-run") == 0){
 	doRun = true;
       }else if(arg.compare("-flash") ==0 && ++i < argc){
 	doFlash = true;
 	flashChecksum = juce::String(argv[i]).getHexValue32();
-	std::cout << "Sending FLASH command with checksum " << std::hex << flashChecksum << std::endl;	
+	std::cout << "Sending FLASH command with checksum " << std::hex << flashChecksum << std::endl;
       }else if(arg.compare("-in") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
 	input = new File(File::getCurrentWorkingDirectory().getChildFile(name));
 	if(!input->exists())
 	  throw CommandLineException("No such file: "+name);
+      }else if(arg.compare("-bank") == 0 && ++i < argc){
+	juce::String name = juce::String(argv[i]);
+	File file = File::getCurrentWorkingDirectory().getChildFile(name);
+	if(!file.exists())
+	  throw CommandLineException("No such file: "+name);
+	loadBank(file);
+      }else if(arg.compare("-delta") == 0 && ++i < argc){
+	juce::String name = juce::String(argv[i]);
+	job.delta = File::getCurrentWorkingDirectory().getChildFile(name);
+	if(!job.delta.exists())
+	  throw CommandLineException("No such file: "+name);
       }else if(arg.compare("-out") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
-	midiout = openMidiOutput(name);
-	if(midiout == NULL)
-	  throw CommandLineException("MIDI device not available: "+name);  
+	job.addTarget(name, deviceNum);
+	hasDeviceNum.add(false);
       }else if(arg.compare("-save") == 0 && ++i < argc){
 	juce::String name = juce::String(argv[i]);
-	fileout = new File(File::getCurrentWorkingDirectory().getChildFile(name));
-	// fileout = new juce::File(name);
+	job.sysexFile = File::getCurrentWorkingDirectory().getChildFile(name);
       }else if(arg.compare("-id") == 0 && ++i < argc){
 	deviceNum = juce::String(argv[i]).getIntValue();
+	if(!job.targets.empty()){
+	  if(hasDeviceNum.getLast()){
+	    // another device on the same bus
+	    job.addTarget(job.targets.back().port, deviceNum);
+	    hasDeviceNum.add(true);
+	    job.useReactor = true; // interleave messages on the shared port
+	  }
+	  job.targets.back().deviceNum = deviceNum;
+	  hasDeviceNum.set(hasDeviceNum.size()-1, true);
+	}
+      }else if(arg.compare("-daemon") == 0 && ++i < argc){
+	daemonPath = File::getCurrentWorkingDirectory().getChildFile(juce::String(argv[i])).getFullPathName();
       }else if(arg.compare("-split") == 0 && ++i < argc){
-	partSize = juce::String(argv[i]).getIntValue() * 1024;
+	job.partSize = juce::String(argv[i]).getIntValue() * 1024;
       }else{
 	usage();
 	throw CommandLineException(juce::String::empty);
       }
     }
-    if(input == NULL || (midiout == NULL && fileout == NULL)){
+    if(daemonPath.isNotEmpty()){
+      if(input != NULL || !bank.empty() || !job.targets.empty())
+	throw CommandLineException("-daemon takes its jobs from the socket");
+      return;
+    }
+    if((input == NULL && bank.empty()) || (job.targets.empty() && job.sysexFile == File())){
       usage();
       throw CommandLineException(juce::String::empty);
     }
-    if(midiout == NULL && blockDelay == DEFAULT_BLOCK_DELAY)
-      blockDelay = 0;
+    if(!bank.empty() && (input != NULL || job.delta != File() || job.partSize))
+      throw CommandLineException("-bank cannot be combined with -in, -delta or -split");
+    if(job.delta != File() && job.partSize)
+      throw CommandLineException("-delta cannot be combined with -split");
+    if(job.autoTune && job.targets.empty())
+      throw CommandLineException("-auto needs a MIDI output");
+    if(job.pipeline && job.partSize == 0 && bank.empty())
+      throw CommandLineException("-pipeline needs -split or -bank");
+    if(inputFormat != FirmwareImage::BY_EXTENSION && input == NULL)
+      throw CommandLineException("-hex and -elf apply to -in");
+    if(bank.empty()){
+      job.addFile(*input, inputFormat);
+      addTail(storeSlot, saveName);
+    }
+    for(int i=0; i<(int)bank.size(); ++i){
+      // items without their own tail go to consecutive slots, or by file name
+      const BankItem& item = bank[i];
+      job.addFile(item.file);
+      if(item.slot < 0 && item.name.isEmpty() && storeSlot >= 0)
+	addTail(storeSlot + i, juce::String::empty);
+      else if(item.slot < 0 && item.name.isEmpty())
+	addTail(-1, item.file.getFileName());
+      else
+	addTail(item.slot, item.name);
+    }
+    job.deviceNum = deviceNum;
+    job.log.verbose = verbose;
+    if(!quiet)
+      job.log.print = [](const juce::String& msg){ std::cout << msg << std::endl; };
+  }
+
+  void addTail(int slot, const juce::String& name){
+    if(slot >= 0)
+      job.store(slot);
+    else if(name.isNotEmpty())
+      job.save(name);
+    else if(doRun)
+      job.run();
+    else if(doFlash)
+      job.flash(flashChecksum);
   }
 
   void run(){
-    running = true;
+    if(daemonPath.isNotEmpty()){
+      runDaemon();
+      return;
+    }
     if(!quiet){
-      std::cout << "Sending file " << input->getFileName() << std::endl; 
-      if(midiout != NULL)
-	std::cout << "\tto MIDI output" << std::endl; 
-      if(fileout != NULL)
-	std::cout << "\tto SysEx file " << fileout->getFullPathName() << std::endl;       
+      if(bank.empty())
+	std::cout << "Sending file " << input->getFileName() << std::endl;
+      else
+	std::cout << "Sending bank of " << bank.size() << " files" << std::endl;
+      for(size_t i=0; i<job.targets.size(); ++i)
+	std::cout << "\tto MIDI output " << job.targets[i].port << std::endl;
+      if(job.sysexFile != File())
+	std::cout << "\tto SysEx file " << job.sysexFile.getFullPathName() << std::endl;
+    }
+    {
+      const ScopedLock sl(lock);
+      if(cancelled)
+	throw CommandLineException("Interrupted");
+      engine = new UploadEngine();
     }
-    juce::ScopedPointer<InputStream> in = input->createInputStream();
-    int size = input->getSize(); // amount of data, excluding checksum
-    int part = 0;
-    while(partSize && size > partSize){
-      sendPart(in, partSize);
-      size -= partSize;
-      if(fileout != NULL){
-	fileout = new File(fileout->getNonexistentSibling());
-	std::cout << "\tto SysEx file " << fileout->getFullPathName() << std::endl;
+    UploadResult result = engine->run(std::move(job));
+    for(size_t i=0; i<result.targets.size(); ++i){
+      const UploadResult::TargetResult& target = result.targets[i];
+      if(quiet && target.error.isEmpty())
+	continue;
+      std::cout << target.device << " (id 0x" << std::hex << (int)target.deviceNum << "): ";
+      if(target.error.isNotEmpty())
+	std::cout << "failed: " << target.error << std::endl;
+      else
+	std::cout << "done in " << std::dec << (int)target.milliseconds << "ms" << std::endl;
+    }
+    if(result.error.isNotEmpty())
+      throw CommandLineException(result.error);
+    if(result.failed())
+      throw CommandLineException("Upload failed");
+  }
+
+  bool isDaemon() const {
+    return daemonPath.isNotEmpty();
+  }
+
+  bool isQuiet() const {
+    return quiet;
+  }
+
+  UploadJob& getJob(){
+    return job;
+  }
+
+  void runDaemon();
+
+  /* read bank items from a directory, or a list file with optional tails */
+  void loadBank(const File& file){
+    if(file.isDirectory()){
+      juce::Array<File> files;
+      file.findChildFiles(files, File::findFiles | File::ignoreHiddenFiles, false);
+      files.sort();
+      for(int i=0; i<files.size(); ++i){
+	BankItem item = { files[i], -1, juce::String::empty };
+	bank.push_back(item);
+      }
+    }else{
+      juce::StringArray lines;
+      file.readLines(lines);
+      for(int n=0; n<lines.size(); ++n){
+	juce::StringArray tokens;
+	tokens.addTokens(lines[n], " \t", "\"");
+	tokens.removeEmptyStrings();
+	if(tokens.isEmpty() || tokens[0].startsWithChar('#'))
+	  continue;
+	BankItem item = { file.getParentDirectory().getChildFile(tokens[0].unquoted()), -1, juce::String::empty };
+	for(int i=1; i<tokens.size(); ++i){
+	  if(tokens[i].compare("-store") == 0 && ++i < tokens.size())
+	    item.slot = tokens[i].getIntValue();
+	  else if(tokens[i].compare("-name") == 0 && ++i < tokens.size())
+	    item.name = tokens[i].unquoted();
+	  else
+	    throw CommandLineException("Invalid bank entry on line "+juce::String(n+1)+": "+lines[n]);
+	}
+	if(!item.file.existsAsFile())
+	  throw CommandLineException("No such file: "+item.file.getFullPathName());
+	bank.push_back(item);
       }
-      if(storeSlot >= 0)
-	storeSlot += partSize/slotSize;
     }
-    sendPart(in, size);
-    stop();
+    if(bank.empty())
+      throw CommandLineException("No files in bank: "+file.getFullPathName());
+  }
+
+  /* from the signal watcher thread, never from the signal handler itself */
+  void shutdown(){
+    const ScopedLock sl(lock);
+    cancelled = true;
+    if(daemon != NULL)
+      daemon->signalThreadShouldExit();
+    if(engine != NULL)
+      engine->cancelAll();
+  }
+
+  juce::String getApplicationName(){
+    return "FirmwareSender";
   }
+};
+
+#ifndef _WIN32
+/*
+ * Keeps MIDI ports open between uploads and takes jobs over a Unix
+ * domain socket. A client sends one line of FirmwareSender options and
+ * reads back progress lines, ending with "done" or "failed: REASON".
+ * Jobs on the same port run one after another, in order of arrival.
+ */
+class UploadDaemon : public juce::Thread {
+private:
+  class Job : public juce::Thread {
+  private:
+    UploadEngine& engine;
+    juce::ScopedPointer<UnixSocket> socket;
+  public:
+    Job(UploadEngine& e, UnixSocket* s) : juce::Thread("DaemonJob"), engine(e), socket(s) {}
 
-  void sendPart(InputStream* in, int size){
-    if(verbose)
-      std::cout << "sending " << std::dec << size << " bytes" << std::endl;
-		
-    const uint8_t header[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_FIRMWARE_UPLOAD };
-    int binblock = (int)floor(blockSize*7/8);
-
-    if(fileout != NULL){
-      fileout->deleteFile();
-      fileout->create();
-      out = fileout->createOutputStream();
+    ~Job(){
+      stopThread(-1);
     }
-    int packageIndex = 0;
-    MemoryBlock block;
-    block.append(header, sizeof(header));
-    encodeInt(block, packageIndex++);
-    unsigned char* buffer = (unsigned char*)alloca(binblock*sizeof(unsigned char));
-    unsigned char* sysex = (unsigned char*)alloca(blockSize*sizeof(unsigned char));
-    encodeInt(block, size);
-    // send first message with index and length
-    send(block);
-
-    uint32_t checksum = 0;
-    for(int i=0; i < size && running;){
-      binblock = std::min(binblock, size-i);
-      block = MemoryBlock();
-      block.append(header, sizeof(header));
-      encodeInt(block, packageIndex++);
-      int len = in->read(buffer, binblock);
-      checksum = crc32(buffer, len, checksum);
-      i += len;
-      if(verbose)
-	std::cout << "preparing " << std::dec << len;
-      len = data_to_sysex(buffer, sysex, len);
-      if(verbose)
-	std::cout << "/" << len << " bytes binary/sysex (total " << 
-	  i << " of " << size << " bytes)" << std::endl;
-      block.append(sysex, len);
-      send(block);
-      if(blockDelay > 0)
-	juce::Time::waitForMillisecondCounter(juce::Time::getMillisecondCounter()+blockDelay);
+
+    /* stop waiting for the client, whether it is sending or reading */
+    void hangUp(){
+      signalThreadShouldExit();
+      socket->hangUp();
     }
 
-    if(running){
-      // last block: package index and checksum
-      block = MemoryBlock();
-      block.append(header, sizeof(header));
-      encodeInt(block, packageIndex++);
-      encodeInt(block, checksum);
-      send(block);
-      if(blockDelay > 0)
-	juce::Time::waitForMillisecondCounter(juce::Time::getMillisecondCounter()+blockDelay);
-
-      if(!quiet)
-	std::cout << "checksum 0x" << std::hex << checksum << std::endl;
-
-      if(storeSlot >= 0){
-	if(!quiet)
-	  std::cout << "store slot " << std::hex << storeSlot << std::endl;
-	const uint8_t tailer[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_FIRMWARE_STORE };
-	block = MemoryBlock();
-	block.append(tailer, sizeof(tailer));
-	encodeInt(block, storeSlot);
-	send(block);
-      }else if(saveName.isNotEmpty()){
-	if(!quiet)
-	  std::cout << "Saving resource with name: " << saveName << std::endl;
-	const uint8_t tailer[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_FIRMWARE_SAVE };
-	block = MemoryBlock();
-	block.append(tailer, sizeof(tailer));
-	block.append(saveName.toUTF8(), saveName.getNumBytesAsUTF8()+1); // include trailing \0
-	send(block);	
-      }else if(doRun){
-	const uint8_t tailer[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_FIRMWARE_RUN };
-	block = MemoryBlock();
-	block.append(tailer, sizeof(tailer));
-	send(block);
-      }else if(doFlash){
-	const uint8_t tailer[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_FIRMWARE_FLASH };
-	block = MemoryBlock();
-	block.append(tailer, sizeof(tailer));
-	encodeInt(block, flashChecksum);
-	send(block);
+    void run(){
+      juce::String line;
+      if(!socket->readLine(line, MAX_JOB_LENGTH, *this))
+	return;
+      juce::StringArray args;
+      args.add("FirmwareSender");
+      args.addTokens(line, " \t", "\"");
+      args.removeEmptyStrings();
+      std::vector<char*> argv;
+      for(int i=0; i<args.size(); ++i){
+	args.set(i, args[i].unquoted());
+	argv.push_back((char*)args[i].toRawUTF8());
+      }
+      juce::String result = "done";
+      try{
+	FirmwareSender options;
+	options.configure(argv.size(), argv.data());
+	if(options.isDaemon())
+	  throw CommandLineException("-daemon is not a job");
+	UploadJob& job = options.getJob();
+	checkSavePath(job.sysexFile);
+	UnixSocket* client = socket;
+	job.onProgress = [client](const juce::String& device, int sent, int total){
+	  client->writeText("progress " + device + " " + juce::String(sent) + "/" + juce::String(total) + "\n", false, false);
+	};
+	UploadResult status = engine.submit(std::move(job)).get();
+	if(status.error.isNotEmpty())
+	  result = "failed: " + status.error;
+	for(size_t i=0; i<status.targets.size() && !result.startsWith("failed"); ++i)
+	  if(status.targets[i].error.isNotEmpty())
+	    result = "failed: " + status.targets[i].device + ": " + status.targets[i].error;
+      }catch(const CommandLineException& exc){
+	result = "failed: " + (exc.getCause().isEmpty() ? "invalid options" : exc.getCause());
+      }catch(const std::exception& exc){
+	result = "failed: " + juce::String(exc.what());
       }
+      socket->writeText(result + "\n", false, false);
     }
+
+    /* jobs come from clients, so they may only write below our directory */
+    static void checkSavePath(const File& file){
+      if(file == File())
+	return;
+      File dir = File::getCurrentWorkingDirectory();
+      if(!file.isAChildOf(dir) || !file.getLinkedTarget().isAChildOf(dir))
+	throw CommandLineException("-save must be within "+dir.getFullPathName());
+    }
+  };
+
+  UnixSocketServer server;
+  UploadEngine engine;
+  juce::OwnedArray<Job> jobs;
+public:
+  UploadDaemon() : juce::Thread("UploadDaemon"), engine(true) {}
+
+  ~UploadDaemon(){
+    stopThread(-1);
   }
 
-  void encodeInt(MemoryBlock& block, uint32_t data){
-    uint8_t in[4];
-    uint8_t out[5];
-    in[3] = (uint8_t)data & 0xff;
-    in[2] = (uint8_t)(data >> 8) & 0xff;
-    in[1] = (uint8_t)(data >> 16) & 0xff;
-    in[0] = (uint8_t)(data >> 24) & 0xff;
-    int len = data_to_sysex(in, out, 4);
-    if(len != 5)
-      throw CommandLineException("Error in sysex conversion"); 
-    block.append(out, len);
+  juce::Result listen(const juce::String& path){
+    return server.listen(path);
   }
 
-  void stop(){
-    if(midiout != NULL)
-      midiout->stopBackgroundThread();
-    if(out != NULL)
-      out->flush();
+  void run(){
+    while(!threadShouldExit()){
+      UnixSocket* client = server.accept(PROGRESS_INTERVAL);
+      for(int i=jobs.size(); --i >= 0;)
+	if(!jobs[i]->isThreadRunning())
+	  jobs.remove(i);
+      if(client != NULL)
+	jobs.add(new Job(engine, client))->startThread();
+    }
+    engine.cancelAll(); // stops uploads in progress
+    for(int i=0; i<jobs.size(); ++i)
+      jobs[i]->hangUp();
+    jobs.clear();
+    server.close();
   }
+};
 
-  void shutdown(){
-    running = false;
+void FirmwareSender::runDaemon(){
+  signal(SIGPIPE, SIG_IGN); // clients may hang up mid job
+  UploadDaemon server;
+  juce::Result result = server.listen(daemonPath);
+  if(result.failed())
+    throw CommandLineException(result.getErrorMessage());
+  if(!quiet)
+    std::cout << "Taking upload jobs on " << daemonPath << std::endl;
+  {
+    const ScopedLock sl(lock);
+    if(cancelled)
+      return;
+    daemon = &server;
   }
+  server.startThread();
+  server.waitForThreadToExit(-1);
+  const ScopedLock sl(lock);
+  daemon = NULL;
+}
+#else
+void FirmwareSender::runDaemon(){
+  throw CommandLineException("-daemon is not supported on this platform");
+}
+#endif
 
-  juce::String getApplicationName(){
-    return "FirmwareSender";
+FirmwareSender* app = NULL;
+
+volatile sig_atomic_t interrupted = 0; // set on SIGINT
+
+/*
+ * Cancels uploads once SIGINT arrived. The handler only sets a flag:
+ * cancelling takes locks, which is not safe inside a signal handler.
+ */
+class SignalWatcher : public juce::Thread {
+public:
+  SignalWatcher() : juce::Thread("SignalWatcher") {}
+
+  ~SignalWatcher(){
+    stopThread(-1);
+  }
+
+  void run(){
+    while(!threadShouldExit() && !interrupted)
+      wait(PROGRESS_INTERVAL);
+    if(interrupted){
+      if(!app->isQuiet())
+	std::cout << "shutting down" << std::endl;
+      app->shutdown();
+    }
   }
 };
- 
-FirmwareSender* app = NULL;
 
 #ifndef _WIN32
 void sigfun(int sig){
-  if(!quiet)
-    std::cout << "shutting down" << std::endl;
-  if(app != NULL)
-    app->shutdown();
+  interrupted = 1;
   (void)signal(SIGINT, SIG_DFL);
 }
 #endif
@@ -331,6 +509,8 @@ int main(int argc, char* argv[]) {
   int status = 0;
   app = new FirmwareSender();
   try{
+    SignalWatcher watcher;
+    watcher.startThread();
     app->configure(argc, argv);
     app->run();
   }catch(const std::exception& exc){
@@ -0,0 +1,316 @@
+#ifndef __LoaderStorage_H__
+#define __LoaderStorage_H__
+
+#include "JuceHeader.h"
+#include "FirmwareLoader.hpp"
+#ifndef _WIN32
+#include <chrono>
+#include <thread>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/*
+ * Host storage policies for BasicFirmwareLoader. The includer defines
+ * MAX_SYSEX_PAYLOAD_SIZE and the error hooks, as for FirmwareLoader.hpp.
+ */
+
+#define MMAP_SYNC_INTERVAL (1024*1024) // start writeback of each decoded megabyte
+#define STREAM_CHUNK_SIZE (64*1024) // bytes written to disk at a time, at aligned offsets
+#define FLASH_PAGE_SIZE (4*1024) // emulated flash is programmed a page at a time
+#define FLASH_SECTOR_SIZE (64*1024) // and erased a sector at a time
+
+/* a heap buffer reset to the base image for each upload */
+class RamStorage : public ContiguousStorage<RamStorage> {
+private:
+  juce::HeapBlock<uint8_t> arena;
+  size_t arenaSize = 0;
+  juce::MemoryBlock base;
+public:
+  void setBase(const void* data, size_t size){
+    base.replaceWith(data, size);
+  }
+
+  uint8_t* getBuffer(size_t size){
+    if(arenaSize < sizeof(ResourceHeader) + size){
+      arenaSize = sizeof(ResourceHeader) + size;
+      arena.realloc(arenaSize);
+    }
+    // copy packages keep what is already in place, erased flash past the base image
+    size_t len = std::min(size, base.getSize());
+    memcpy(arena + sizeof(ResourceHeader), base.getData(), len);
+    memset(arena + sizeof(ResourceHeader) + len, 0xff, size - len);
+    return arena;
+  }
+};
+
+#ifndef _WIN32
+
+/*
+ * The output file mapped at exactly the size of the upload, so that the
+ * loader decodes straight into it. The resource header goes in an
+ * anonymous page just in front of the file mapping.
+ */
+class MappedFileStorage : public ContiguousStorage<MappedFileStorage> {
+private:
+  int fd = -1;
+  juce::File base;
+  uint8_t* region = NULL;
+  size_t regionSize = 0;
+  size_t size = 0;
+  size_t synced = 0;
+  size_t page;
+
+  void unmap(){
+    if(region != NULL)
+      munmap(region, regionSize);
+    region = NULL;
+  }
+
+public:
+  MappedFileStorage() : page(sysconf(_SC_PAGESIZE)) {}
+
+  ~MappedFileStorage(){
+    unmap();
+    if(fd >= 0)
+      ::close(fd);
+  }
+
+  juce::Result open(const juce::File& file, const juce::File& baseImage){
+    fd = ::open(file.getFullPathName().toRawUTF8(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+      return juce::Result::fail("Cannot write " + file.getFullPathName() + ": " + juce::String(strerror(errno)));
+    base = baseImage;
+    return juce::Result::ok();
+  }
+
+  /* bounded by address space rather than memory */
+  size_t getCapacity(){
+    return SIZE_MAX - page;
+  }
+
+  /* resize and map the file for an upload of bytes, preloaded with the base image */
+  uint8_t* getBuffer(size_t bytes){
+    unmap();
+    size = bytes;
+    synced = 0;
+    regionSize = page + (bytes + page-1)/page*page;
+    if(ftruncate(fd, 0) != 0 || ftruncate(fd, bytes) != 0)
+      return NULL;
+    void* p = mmap(NULL, regionSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED)
+      return NULL;
+    region = (uint8_t*)p;
+    if(bytes > 0){
+      if(mmap(region+page, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED){
+	unmap();
+	return NULL;
+      }
+      madvise(region+page, bytes, MADV_SEQUENTIAL);
+    }
+    // copy packages keep what is already in place, erased flash past the base image
+    size_t len = 0;
+    if(base != juce::File()){
+      juce::ScopedPointer<juce::FileInputStream> in = base.createInputStream();
+      if(in != NULL)
+	len = std::max(0, in->read(region+page, (int)std::min((juce::int64)bytes, base.getSize())));
+    }
+    memset(region+page+len, 0xff, bytes-len);
+    return region + page - sizeof(ResourceHeader);
+  }
+
+  /* start writing back what has been decoded so far */
+  bool commit(size_t len){
+    offset += len;
+    size_t end = offset/page*page;
+    if(end >= synced + MMAP_SYNC_INTERVAL){
+      msync(region+page+synced, end-synced, MS_ASYNC);
+      synced = end;
+    }
+    return true;
+  }
+
+  bool finish(){
+    if(region != NULL && size > 0)
+      msync(region+page, size, MS_ASYNC);
+    unmap();
+    return true;
+  }
+
+  /* drop a failed upload, leaving an empty file */
+  void discard(){
+    unmap();
+    if(fd >= 0 && ftruncate(fd, 0) != 0)
+      std::cerr << "cannot truncate output: " << strerror(errno) << std::endl;
+  }
+};
+
+/*
+ * Writes pages to a file with no limit on its size. The file is
+ * preallocated for each upload and truncated if it fails. Delta uploads
+ * read the base image from its file as copy packages need it.
+ */
+class FileWriter {
+protected:
+  int fd = -1;
+  int basefd = -1;
+
+  bool failed(const char* what){
+    std::cerr << what << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+
+public:
+  ~FileWriter(){
+    if(fd >= 0)
+      ::close(fd);
+    if(basefd >= 0)
+      ::close(basefd);
+  }
+
+  juce::Result open(const juce::File& file, const juce::File& base){
+    fd = ::open(file.getFullPathName().toRawUTF8(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0)
+      return juce::Result::fail("Cannot write " + file.getFullPathName() + ": " + juce::String(strerror(errno)));
+    if(base != juce::File()){
+      basefd = ::open(base.getFullPathName().toRawUTF8(), O_RDONLY);
+      if(basefd < 0)
+	return juce::Result::fail("Cannot read " + base.getFullPathName() + ": " + juce::String(strerror(errno)));
+    }
+    return juce::Result::ok();
+  }
+
+  bool begin(size_t size){
+    if(ftruncate(fd, 0) != 0)
+      return failed("truncate failed");
+#ifdef __linux__
+    int err = posix_fallocate(fd, 0, size);
+    if(err != 0 && err != EOPNOTSUPP && err != EINVAL){
+      errno = err;
+      return failed("cannot allocate output");
+    }
+#endif
+    return true;
+  }
+
+  bool write(size_t address, const uint8_t* data, size_t len){
+    if(pwrite(fd, data, len, address) != (ssize_t)len)
+      return failed("write failed");
+    return true;
+  }
+
+  /* bytes of the base image, erased flash past its end */
+  void read(size_t address, uint8_t* data, size_t len){
+    ssize_t got = basefd < 0 ? 0 : pread(basefd, data, len, address);
+    if(got < 0){
+      failed("base image read failed");
+      got = 0;
+    }
+    memset(data+got, 0xff, len-got);
+  }
+
+  void discard(){
+    if(fd >= 0 && ftruncate(fd, 0) != 0)
+      failed("cannot truncate output");
+  }
+};
+
+typedef PageStorage<FileWriter, STREAM_CHUNK_SIZE, STREAM_CHUNK_SIZE> FileStreamStorage;
+
+/*
+ * Flash backed by a file, written a page at a time on a thread of its
+ * own. Each page takes the program latency, and the first page in each
+ * sector the erase latency as well. Keeps count of the time the loader
+ * spends waiting for it, to benchmark how well decoding overlaps.
+ */
+class FlashEmulator : public FileWriter, public juce::Thread {
+private:
+  int programLatency = 0; // microseconds per page
+  int eraseLatency = 0; // milliseconds per sector
+  juce::WaitableEvent started;
+  juce::WaitableEvent done;
+  juce::Atomic<int> busy;
+  const uint8_t* data = NULL;
+  size_t address = 0;
+  size_t length = 0;
+  size_t erased = 0; // end of the sectors erased so far
+  bool ok = true;
+  int pages = 0;
+  int sectors = 0;
+  double waited = 0; // milliseconds
+public:
+  FlashEmulator() : juce::Thread("FlashEmulator") {}
+
+  ~FlashEmulator(){
+    signalThreadShouldExit();
+    started.signal();
+    stopThread(-1);
+  }
+
+  void setLatency(int program, int erase){
+    programLatency = program;
+    eraseLatency = erase;
+  }
+
+  int getPagesProgrammed() const {
+    return pages;
+  }
+
+  int getSectorsErased() const {
+    return sectors;
+  }
+
+  /* milliseconds the loader spent waiting for writes */
+  double getWaitTime() const {
+    return waited;
+  }
+
+  bool begin(size_t size){
+    if(!isThreadRunning())
+      startThread();
+    erased = 0;
+    ok = true;
+    return FileWriter::begin(size);
+  }
+
+  void write(size_t addr, const uint8_t* src, size_t len){
+    data = src;
+    address = addr;
+    length = len;
+    busy = 1;
+    started.signal();
+  }
+
+  bool wait(){
+    double start = juce::Time::getMillisecondCounterHiRes();
+    while(busy.get())
+      done.wait(-1);
+    waited += juce::Time::getMillisecondCounterHiRes() - start;
+    return ok;
+  }
+
+  void run(){
+    while(!threadShouldExit()){
+      started.wait(-1);
+      if(!busy.get())
+	continue;
+      while(erased < address + length){
+	sleep(eraseLatency);
+	erased += FLASH_SECTOR_SIZE;
+	sectors++;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(programLatency));
+      ok = FileWriter::write(address, data, length);
+      pages++;
+      busy = 0;
+      done.signal();
+    }
+  }
+};
+
+typedef DoubleBufferedPageStorage<FlashEmulator, FLASH_PAGE_SIZE, STREAM_CHUNK_SIZE> FlashEmulatorStorage;
+
+#endif // _WIN32
+
+#endif // __LoaderStorage_H__
@@ -112,12 +112,17 @@ enum OpenWareMidiSysexCommand {
   SYSEX_SETTINGS_STORE            = 0x16,
   SYSEX_FIRMWARE_SAVE             = 0x17,
   SYSEX_FIRMWARE_SEND             = 0x18,
+  SYSEX_FIRMWARE_COPY             = 0x19,
+  SYSEX_FIRMWARE_FILL             = 0x1a,
+  SYSEX_FIRMWARE_OFFSET           = 0x1b,
   SYSEX_FIRMWARE_VERSION          = 0x20,
   SYSEX_DEVICE_ID                 = 0x21,
   SYSEX_PROGRAM_MESSAGE           = 0x22,
   SYSEX_DEVICE_STATS              = 0x23,
   SYSEX_PROGRAM_STATS             = 0x24,
   SYSEX_BOOTLOADER_VERSION        = 0x25,
+  SYSEX_DEVICE_CAPABILITIES       = 0x26,
+  SYSEX_DEVICE_ECHO               = 0x27,
   SYSEX_PROGRAM_ERROR             = 0x30
 };
 
@@ -0,0 +1,83 @@
+#ifndef __SysExForwarder_H__
+#define __SysExForwarder_H__
+
+#include <string.h>
+#include "JuceHeader.h"
+
+#define SYSEX_CHECK_SIZE 16 // bytes compared at either end of the message so far
+
+/*
+ * Passes the MIDI of one input port on to a queue, with SysEx messages
+ * in pieces as JUCE's MidiDataConcatenator reports them: every partial
+ * callback has the whole message so far. The concatenator starts over
+ * without notice when an F0 cuts a message short, so a piece only
+ * carries on the message under way if it is at least as long and
+ * starts and ends the bytes seen so far the same. Anything else is a
+ * new message. Only the ends are kept, so each piece costs its own size.
+ *
+ * Queue needs push(port, kind, data, size) for the SYSEX_BEGIN,
+ * SYSEX_MORE, SYSEX_END and SYSEX_ABORT kinds, and push(port, message),
+ * both returning false when full.
+ */
+template<class Queue>
+class SysExForwarder {
+private:
+  Queue& queue;
+  const int port;
+  uint8_t head[SYSEX_CHECK_SIZE]; // the start of the message under way, from the F0 on
+  uint8_t tail[SYSEX_CHECK_SIZE]; // and the last bytes of it seen so far
+  size_t size = 0;
+  bool lost = false; // a piece did not fit the queue, drop the rest
+
+  bool continues(const uint8_t* data, size_t len) const {
+    size_t checked = std::min(size, (size_t)SYSEX_CHECK_SIZE);
+    return size > 0 && len >= size && memcmp(data, head, checked) == 0 &&
+      memcmp(data+size-checked, tail, checked) == 0;
+  }
+
+  void abort(){
+    if(size > 0 && !lost)
+      queue.push(port, Queue::SYSEX_ABORT, NULL, 0);
+    size = 0;
+    lost = false;
+  }
+
+public:
+  SysExForwarder(Queue& q, int p) : queue(q), port(p) {}
+
+  /* a complete message, which may end the SysEx under way */
+  void handleMessage(const juce::MidiMessage& message){
+    const uint8_t* data = message.getRawData();
+    size_t len = message.getRawDataSize();
+    if(message.isSysEx() && len > size && continues(data, len)){
+      if(!lost)
+	queue.push(port, Queue::SYSEX_END, data+size, len-size);
+      size = 0;
+      lost = false;
+      return;
+    }
+    if(message.isSysEx() || data[0] < 0xf8)
+      abort(); // anything but realtime messages cuts the SysEx under way short
+    queue.push(port, message);
+  }
+
+  /* the SysEx under way so far, or the start of a new one */
+  void handlePartial(const uint8_t* data, int numBytesSoFar){
+    size_t len = numBytesSoFar;
+    if(!continues(data, len))
+      abort();
+    if(!lost && len > size){
+      if(!queue.push(port, size == 0 ? Queue::SYSEX_BEGIN : Queue::SYSEX_MORE, data+size, len-size)){
+	queue.push(port, Queue::SYSEX_ABORT, NULL, 0);
+	lost = true;
+      }
+    }
+    size_t checked = std::min(len, (size_t)SYSEX_CHECK_SIZE);
+    if(size < checked)
+      memcpy(head, data, checked);
+    memcpy(tail, data+len-checked, checked);
+    size = len;
+  }
+};
+
+#endif // __SysExForwarder_H__
@@ -0,0 +1,168 @@
+#ifndef __UnixSocket_H__
+#define __UnixSocket_H__
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "JuceHeader.h"
+
+#define SOCKET_POLL_INTERVAL 100 // milliseconds between checks for a thread exit
+
+/*
+ * A connected Unix domain stream socket. Replies are written through
+ * the OutputStream interface, requests are read a line at a time.
+ */
+class UnixSocket : public juce::OutputStream {
+private:
+  int fd;
+  juce::int64 written = 0;
+public:
+  UnixSocket(int f) : fd(f) {}
+
+  ~UnixSocket(){
+    ::close(fd);
+  }
+
+  /*
+   * Read up to a newline or end of stream, false if nothing was read. An
+   * idle client does not hold up the thread: it gives up as soon as it
+   * is asked to exit.
+   */
+  bool readLine(juce::String& line, int maxLength, juce::Thread& thread){
+    juce::MemoryOutputStream buffer;
+    char c = 0;
+    ssize_t len = 0;
+    while(buffer.getDataSize() < (size_t)maxLength){
+      struct pollfd pfd = { fd, POLLIN, 0 };
+      int ret = ::poll(&pfd, 1, SOCKET_POLL_INTERVAL);
+      if(thread.threadShouldExit())
+	return false;
+      if(ret == 0 || (ret < 0 && errno == EINTR))
+	continue;
+      if(ret < 0 || (len = ::read(fd, &c, 1)) != 1 || c == '\n')
+	break;
+      buffer.writeByte(c);
+    }
+    line = buffer.toUTF8().trimEnd();
+    return buffer.getDataSize() > 0 || (len == 1 && c == '\n');
+  }
+
+  /* wake up reads and writes blocked on the connection, which fail from now on */
+  void hangUp(){
+    ::shutdown(fd, SHUT_RDWR);
+  }
+
+  bool write(const void* data, size_t size){
+    const char* p = (const char*)data;
+    while(size > 0){
+      ssize_t len = ::write(fd, p, size);
+      if(len <= 0)
+	return false; // client went away
+      p += len;
+      size -= len;
+      written += len;
+    }
+    return true;
+  }
+
+  void flush(){}
+
+  juce::int64 getPosition(){
+    return written;
+  }
+
+  bool setPosition(juce::int64){
+    return false;
+  }
+};
+
+/*
+ * Listens on a socket file, which is removed again when closed. Only
+ * the owner may connect: the file is created with mode 0600 and clients
+ * running as another user are turned away.
+ */
+class UnixSocketServer {
+private:
+  int fd = -1;
+  juce::String path;
+public:
+  ~UnixSocketServer(){
+    close();
+  }
+
+  juce::Result listen(const juce::String& p){
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(p.getNumBytesAsUTF8() >= sizeof(addr.sun_path))
+      return juce::Result::fail("Socket path too long: "+p);
+    strcpy(addr.sun_path, p.toRawUTF8());
+    struct stat st;
+    if(stat(addr.sun_path, &st) == 0){
+      if(!S_ISSOCK(st.st_mode))
+	return juce::Result::fail("Not a socket: "+p);
+      ::unlink(addr.sun_path); // left over from an earlier run
+    }
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = ::umask(0177); // bind creates the file, with no access for others
+    int ret = fd < 0 ? -1 : ::bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+    ::umask(mask);
+    if(ret != 0 || ::listen(fd, SOMAXCONN) != 0){
+      close();
+      return juce::Result::fail("Cannot listen on "+p+": "+juce::String(strerror(errno)));
+    }
+    path = p;
+    return juce::Result::ok();
+  }
+
+  /* wait up to timeout milliseconds for a client, NULL if none connected */
+  UnixSocket* accept(int timeout){
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if(::poll(&pfd, 1, timeout) <= 0)
+      return NULL;
+    int client = ::accept(fd, NULL, NULL);
+    if(client < 0)
+      return NULL;
+    if(!isOwner(client)){
+      ::close(client);
+      return NULL;
+    }
+    return new UnixSocket(client);
+  }
+
+  /* whether the peer of a connected socket runs as our own user */
+  static bool isOwner(int client){
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(::getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+      return false;
+    return cred.uid == ::geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if(::getpeereid(client, &uid, &gid) != 0)
+      return false;
+    return uid == ::geteuid();
+#endif
+  }
+
+  void close(){
+    if(fd >= 0)
+      ::close(fd);
+    fd = -1;
+    if(path.isNotEmpty())
+      ::unlink(path.toRawUTF8());
+    path = juce::String::empty;
+  }
+};
+
+#endif // _WIN32
+
+#endif // __UnixSocket_H__
@@ -0,0 +1,1368 @@
+#ifndef __UploadEngine_H__
+#define __UploadEngine_H__
+
+/*
+ * OWL SysEx upload engine: encodes firmware, patches and resources and
+ * streams them to devices over MIDI. Header only; link with sysex.c,
+ * crc32.c and the juce_core, juce_events, juce_audio_basics and
+ * juce_audio_devices modules.
+ */
+
+#include <stdint.h>
+#include <math.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+#include "JuceHeader.h"
+#include "OpenWareMidiControl.h"
+#include "crc32.h"
+#include "sysex.h"
+#include "MidiStatus.h"
+#include "FirmwareImage.hpp"
+
+#define MESSAGE_SIZE 8
+#define DEFAULT_BLOCK_SIZE (248-MESSAGE_SIZE)
+#define MIN_MESSAGE_SIZE (MESSAGE_SIZE+8) // a header and one group of seven bytes
+#define DEFAULT_BLOCK_DELAY 20 // wait in milliseconds between sysex messages
+#define QUERY_TIMEOUT 250 // wait in milliseconds for device replies
+#define CALIBRATION_PROBES 16 // echo messages sent per calibration burst
+#define MIN_AUTO_BLOCK_SIZE 64
+#define STORE_TIMEOUT 10000 // wait in milliseconds for the device to store a part
+#define STORE_POLL 1 // check for store acknowledgements every millisecond
+#define JOB_PACKAGES 256 // messages encoded per thread pool job
+#define PROGRESS_INTERVAL 100 // report job progress every 100 milliseconds
+#define DEFAULT_SLOT_SIZE (128*1024) // bytes of data per store slot
+
+/* status messages from the engine, detail ones only when verbose */
+struct UploadLog {
+  std::function<void(const juce::String&)> print;
+  bool verbose = false;
+
+  void status(const juce::String& msg) const {
+    if(print)
+      print(msg);
+  }
+
+  void detail(const juce::String& msg) const {
+    if(print && verbose)
+      print(msg);
+  }
+};
+
+class UploadException : public std::exception {
+private:
+  juce::String cause;
+public:
+  UploadException(juce::String c) : cause(c) {}
+  juce::String getCause() const {
+    return cause;
+  }
+  const char* what() const noexcept {
+    return cause.toRawUTF8();
+  }
+};
+
+/* length of the run of value at the start of data, compared a word at a time */
+static int fillRunLength(const uint8_t* data, int size, uint8_t value){
+  const uint64_t pattern = 0x0101010101010101ULL * value;
+  int i = 0;
+  for(; i+8 <= size; i += 8){
+    uint64_t word;
+    memcpy(&word, data+i, sizeof(word));
+    if(word != pattern)
+      break;
+  }
+  while(i < size && data[i] == value)
+    i++;
+  return i;
+}
+
+/* decode a 32-bit unsigned integer from 5 bytes of sysex encoded data */
+static uint32_t decodeInt(uint8_t *data){
+  uint8_t buf[4];
+  sysex_to_data(data, buf, 5);
+  return buf[3] | (buf[2] << 8L) | (buf[1] << 16L) | (buf[0] << 24L);
+}
+
+/* encode a 32-bit unsigned integer as 5 bytes of sysex data */
+static void encodeInt(uint8_t* out, uint32_t data){
+  uint8_t in[4];
+  in[3] = (uint8_t)data & 0xff;
+  in[2] = (uint8_t)(data >> 8) & 0xff;
+  in[1] = (uint8_t)(data >> 16) & 0xff;
+  in[0] = (uint8_t)(data >> 24) & 0xff;
+  data_to_sysex(in, out, 4);
+}
+
+static void encodeInt(MemoryBlock& block, uint32_t data){
+  uint8_t out[5];
+  encodeInt(out, data);
+  block.append(out, 5);
+}
+
+/* number of sysex bytes needed to carry len bytes of data */
+static size_t sysexLength(size_t len){
+  return len/7*8 + (len%7 ? len%7+1 : 0);
+}
+
+/* the SysEx messages of one part, without F0/F7, back to back in one block */
+class FrameList {
+private:
+  juce::MemoryBlock arena;
+  juce::Array<size_t> ends; // end of each message in the arena
+  size_t used = 0;
+public:
+  void reserve(size_t bytes){
+    arena.ensureSize(bytes);
+  }
+
+  int size() const {
+    return ends.size();
+  }
+
+  uint8_t* getData(int i) const {
+    return (uint8_t*)arena.getData() + (i > 0 ? ends[i-1] : 0);
+  }
+
+  size_t getSize(int i) const {
+    return ends[i] - (i > 0 ? ends[i-1] : 0);
+  }
+
+  /* make room for a message of length bytes, returns its index */
+  int allocate(size_t length){
+    arena.ensureSize(used+length);
+    used += length;
+    ends.add(used);
+    return ends.size()-1;
+  }
+
+  void add(const MemoryBlock& block){
+    int i = allocate(block.getSize());
+    memcpy(getData(i), block.getData(), block.getSize());
+  }
+};
+
+/* one upload message, planned before it is encoded */
+struct Package {
+  uint8_t command;
+  int offset; // part data covered by the package
+  int length;
+  int frame; // message index, which is also the package index
+};
+
+/*
+ * Encodes a run of planned packages of one part into their place in the
+ * arena, and checksums the part data they cover so that the part
+ * checksum can be combined from the runs.
+ */
+class EncodeJob : public juce::ThreadPoolJob {
+private:
+  const uint8_t* buffer;
+  FrameList& frames;
+  juce::Array<Package> packages;
+  uint8_t deviceNum;
+public:
+  uint32_t crc = 0;
+  int length = 0;
+
+  EncodeJob(const uint8_t* data, FrameList& f, uint8_t id)
+    : juce::ThreadPoolJob("EncodeJob"), buffer(data), frames(f), deviceNum(id) {}
+
+  void add(const Package& package){
+    packages.add(package);
+    length += package.length;
+  }
+
+  int size() const {
+    return packages.size();
+  }
+
+  JobStatus runJob(){
+    for(int i=0; i<packages.size(); ++i){
+      const Package& p = packages.getReference(i);
+      uint8_t* msg = frames.getData(p.frame);
+      msg[0] = MIDI_SYSEX_MANUFACTURER;
+      msg[1] = deviceNum;
+      msg[2] = p.command;
+      encodeInt(msg+3, p.frame);
+      switch(p.command){
+      case SYSEX_FIRMWARE_UPLOAD:
+	data_to_sysex((uint8_t*)buffer+p.offset, msg+MESSAGE_SIZE, p.length);
+	break;
+      case SYSEX_FIRMWARE_FILL:
+	encodeInt(msg+MESSAGE_SIZE, p.length);
+	encodeInt(msg+MESSAGE_SIZE+5, buffer[p.offset]);
+	break;
+      case SYSEX_FIRMWARE_OFFSET:
+	encodeInt(msg+MESSAGE_SIZE, p.offset+p.length); // next populated offset
+	break;
+      default: // SYSEX_FIRMWARE_COPY
+	encodeInt(msg+MESSAGE_SIZE, p.length);
+	break;
+      }
+    }
+    if(!packages.isEmpty())
+      crc = crc32(buffer+packages[0].offset, length, 0);
+    return jobHasFinished;
+  }
+};
+
+/*
+ * A MIDI output, and the input with the same name if there is one.
+ * Shared by all upload targets on the same bus; replies are passed on
+ * to each of them.
+ */
+class MidiPort : public juce::ReferenceCountedObject, public juce::MidiInputCallback {
+private:
+  juce::ScopedPointer<MidiOutput> midiout;
+  juce::ScopedPointer<MidiInput> midiin;
+  juce::String name;
+  juce::CriticalSection sendLock;
+  juce::CriticalSection listenerLock;
+  juce::Array<juce::MidiInputCallback*> listeners;
+  juce::CriticalSection turnLock;
+  juce::WaitableEvent turnEnded;
+  int nextTicket = 0;
+  int serving = 0;
+  juce::SortedSet<int> abandoned; // tickets given up before their turn
+public:
+  typedef juce::ReferenceCountedObjectPtr<MidiPort> Ptr;
+
+  /* ports kept open between jobs, when enabled */
+  struct Cache {
+    juce::CriticalSection lock;
+    juce::ReferenceCountedArray<MidiPort> ports;
+    bool enabled = false;
+  };
+
+  static Cache& getCache(){
+    static Cache cache;
+    return cache;
+  }
+
+  /* takes the output, which subclasses sending elsewhere may leave NULL */
+  MidiPort(MidiOutput* output, const juce::String& n) : midiout(output), name(n) {}
+
+  ~MidiPort(){
+    midiin = NULL;
+    if(midiout != NULL)
+      midiout->stopBackgroundThread();
+  }
+
+  static MidiPort* open(const String& pattern, const UploadLog& log){
+    Cache& cache = getCache();
+    const ScopedLock sl(cache.lock);
+    for(int i=0; i<cache.ports.size(); ++i)
+      if(cache.ports[i]->getName().matchesWildcard(pattern, true))
+	return cache.ports[i];
+    MidiPort* port = NULL;
+    StringArray outputs = MidiOutput::getDevices();
+    for(int i=0; i<outputs.size(); ++i){
+      if(outputs[i].trim().matchesWildcard(pattern, true)){
+	log.detail("opening MIDI output " + outputs[i]);
+	MidiOutput* output = MidiOutput::openDevice(i);
+	if(output != NULL){
+	  output->startBackgroundThread();
+	  port = new MidiPort(output, outputs[i].trim());
+	  port->openMidiInput(pattern, log);
+	}
+	break;
+      }
+    }
+    if(port != NULL && cache.enabled)
+      cache.ports.add(port);
+    return port;
+  }
+
+  void openMidiInput(const String& pattern, const UploadLog& log){
+    StringArray inputs = MidiInput::getDevices();
+    for(int i=0; i<inputs.size(); ++i){
+      if(inputs[i].trim().matchesWildcard(pattern, true)){
+	log.detail("opening MIDI input " + inputs[i]);
+	midiin = MidiInput::openDevice(i, this);
+	if(midiin != NULL)
+	  midiin->start();
+	break;
+      }
+    }
+  }
+
+  const juce::String& getName() const {
+    return name;
+  }
+
+  virtual bool hasInput() const {
+    return midiin != NULL;
+  }
+
+  virtual void send(const juce::MidiMessage& msg){
+    const ScopedLock sl(sendLock);
+    midiout->sendMessageNow(msg);
+  }
+
+  /* jobs take turns on a port in the order they took tickets */
+  int takeTicket(){
+    const ScopedLock sl(turnLock);
+    return nextTicket++;
+  }
+
+  /* false if cancelled first, the ticket must then still be ended */
+  bool waitForTurn(int ticket, const juce::Atomic<int>& running){
+    while(running.get()){
+      {
+	const ScopedLock sl(turnLock);
+	if(serving == ticket)
+	  return true;
+      }
+      turnEnded.wait(PROGRESS_INTERVAL);
+    }
+    return false;
+  }
+
+  /* done with a ticket, whether or not its turn came */
+  void endTurn(int ticket){
+    {
+      const ScopedLock sl(turnLock);
+      abandoned.add(ticket);
+      while(abandoned.contains(serving))
+	abandoned.removeValue(serving++);
+    }
+    turnEnded.signal();
+  }
+
+  void addListener(juce::MidiInputCallback* listener){
+    const ScopedLock sl(listenerLock);
+    listeners.add(listener);
+  }
+
+  void removeListener(juce::MidiInputCallback* listener){
+    const ScopedLock sl(listenerLock);
+    listeners.removeFirstMatchingValue(listener);
+  }
+
+  void handleIncomingMidiMessage(MidiInput *source, const MidiMessage &message){
+    const ScopedLock sl(listenerLock);
+    for(int i=0; i<listeners.size(); ++i)
+      listeners[i]->handleIncomingMidiMessage(source, message);
+  }
+};
+
+/*
+ * One OWL device id on a MIDI port. Each target transmits the shared,
+ * already encoded parts with its own pacing, patching only the device
+ * byte of each message.
+ */
+class UploadTarget : public juce::MidiInputCallback, public juce::Thread {
+private:
+  MidiPort::Ptr port;
+  juce::String deviceName;
+  juce::WaitableEvent capabilities;
+  uint32_t maxSysexSize = 0;
+  int partBuffers = 1; // parts the device can hold while storing
+  juce::Atomic<int> stored; // store acknowledgements received
+  double waitStart = 0; // when we started waiting for a free part buffer
+  juce::CriticalSection echoLock;
+  juce::Array<double> echoes; // reply time of each calibration probe
+  int echoCount = 0;
+  juce::WaitableEvent echoReceived;
+  const juce::OwnedArray<FrameList>* parts = NULL;
+  int part = 0;
+  int frame = 0;
+  double due = 0; // when the next message may be sent
+  double startTime = 0;
+  double endTime = 0;
+  juce::Atomic<int> sentBytes;
+  int totalBytes = 0;
+  juce::String error;
+  const UploadLog& log;
+public:
+  uint8_t deviceNum;
+  bool sharedPort = false; // other targets of the job use the same port
+  bool pipeline = false;
+  int blockDelay = DEFAULT_BLOCK_DELAY;
+  int messageSize = DEFAULT_BLOCK_SIZE+MESSAGE_SIZE;
+
+  UploadTarget(MidiPort* p, uint8_t id, const UploadLog& l)
+    : juce::Thread("UploadTarget"), port(p), deviceName(p->getName()), log(l), deviceNum(id) {
+    port->addListener(this);
+  }
+
+  ~UploadTarget(){
+    stopThread(-1);
+    port->removeListener(this);
+  }
+
+  static UploadTarget* open(const String& name, uint8_t id, const UploadLog& log){
+    MidiPort* port = MidiPort::open(name, log);
+    return port == NULL ? NULL : new UploadTarget(port, id, log);
+  }
+
+  MidiPort* getPort() const {
+    return port;
+  }
+
+  const juce::String& getDeviceName() const {
+    return deviceName;
+  }
+
+  /* a reply from our device; omni ones are only ours alone on the port */
+  bool isOwnReply(uint8_t device) const {
+    if(device == deviceNum)
+      return true;
+    return !sharedPort && (device == MIDI_SYSEX_OMNI_DEVICE || deviceNum == MIDI_SYSEX_OMNI_DEVICE);
+  }
+
+  void handleIncomingMidiMessage(MidiInput *source, const MidiMessage &message){
+    if(!message.isSysEx() || message.getSysExDataSize() < 3+5)
+      return;
+    uint8_t* data = (uint8_t*)message.getSysExData();
+    if(data[0] != MIDI_SYSEX_MANUFACTURER || !isOwnReply(data[1]))
+      return;
+    if(data[2] == SYSEX_DEVICE_CAPABILITIES){
+      maxSysexSize = decodeInt(data+3);
+      if(message.getSysExDataSize() >= 3+5+5)
+	partBuffers = std::max(1, (int)decodeInt(data+3+5));
+      capabilities.signal();
+    }else if(data[2] == SYSEX_DEVICE_ECHO){
+      uint32_t index = decodeInt(data+3);
+      const ScopedLock sl(echoLock);
+      if(index < (uint32_t)echoes.size() && echoes[index] < 0){
+	echoes.set(index, juce::Time::getMillisecondCounterHiRes());
+	echoCount++;
+	echoReceived.signal();
+      }
+    }else if(data[2] == SYSEX_FIRMWARE_STORE){
+      ++stored;
+    }
+  }
+
+  /* ask the device for the largest SysEx message it can buffer */
+  void requestCapabilities(){
+    capabilities.reset();
+    if(port->hasInput())
+      port->send(juce::MidiMessage::controllerEvent(1, REQUEST_SETTINGS, SYSEX_DEVICE_CAPABILITIES));
+  }
+
+  bool waitForCapabilities(int timeout){
+    if(!port->hasInput()){
+      log.detail(deviceName + ": no MIDI input to query device capabilities");
+      return false;
+    }
+    bool replied = capabilities.wait(std::max(timeout, 0));
+    if(replied && maxSysexSize >= MIN_MESSAGE_SIZE){
+      log.status(deviceName + ": device accepts SysEx messages of " + juce::String(maxSysexSize) +
+		 " bytes, holds " + juce::String(partBuffers) + " parts");
+      return true;
+    }
+    if(replied)
+      log.status(deviceName + ": device reports SysEx messages of only " + juce::String(maxSysexSize) +
+		 " bytes, using default block size");
+    else
+      log.detail(deviceName + ": no reply to capability query, using default block size");
+    return false;
+  }
+
+  /* send a burst of echo requests of size bytes, delay ms apart.
+   * Succeeds if every probe is answered and replies do not queue up. */
+  bool probe(int size, int delay){
+    double sent[CALIBRATION_PROBES];
+    {
+      const ScopedLock sl(echoLock);
+      echoes.clearQuick();
+      echoes.insertMultiple(0, -1.0, CALIBRATION_PROBES);
+      echoCount = 0;
+    }
+    const uint8_t header[] =  { MIDI_SYSEX_MANUFACTURER, deviceNum, SYSEX_DEVICE_ECHO };
+    MemoryBlock padding(size - MESSAGE_SIZE, true);
+    for(int i=0; i<CALIBRATION_PROBES && !threadShouldExit(); ++i){
+      MemoryBlock block;
+      block.append(header, sizeof(header));
+      encodeInt(block, i);
+      block.append(padding.getData(), padding.getSize());
+      sent[i] = juce::Time::getMillisecondCounterHiRes();
+      port->send(juce::MidiMessage::createSysExMessage(block.getData(), block.getSize()));
+      if(delay > 0)
+	juce::Time::waitForMillisecondCounter(juce::Time::getMillisecondCounter()+delay);
+    }
+    uint32_t deadline = juce::Time::getMillisecondCounter()+QUERY_TIMEOUT;
+    for(;;){
+      {
+	const ScopedLock sl(echoLock);
+	if(echoCount == CALIBRATION_PROBES)
+	  break;
+      }
+      int remaining = deadline - juce::Time::getMillisecondCounter();
+      if(remaining <= 0 || !echoReceived.wait(remaining))
+	break;
+    }
+    const ScopedLock sl(echoLock);
+    int lost = CALIBRATION_PROBES - echoCount;
+    double first = echoes[0] - sent[0];
+    double last = echoes[CALIBRATION_PROBES-1] - sent[CALIBRATION_PROBES-1];
+    log.detail(deviceName + ": probe " + juce::String(size) + " bytes every " + juce::String(delay) + "ms: " +
+	       juce::String(lost) + " lost, latency " + juce::String(first) + "/" + juce::String(last) + "ms");
+    return lost == 0 && last <= 2*first + 2;
+  }
+
+  /* find the largest message size, then the shortest delay, the device keeps up with */
+  void calibrate(){
+    if(!port->hasInput())
+      throw UploadException("Tuning needs a MIDI input for device replies: "+deviceName);
+    int size = messageSize;
+    while(!probe(size, blockDelay)){
+      if(size <= MIN_AUTO_BLOCK_SIZE)
+	throw UploadException("Device does not answer calibration probes: "+deviceName);
+      size = std::max(size/2, MIN_AUTO_BLOCK_SIZE);
+    }
+    int delay = blockDelay;
+    while(delay > 0 && probe(size, delay/2))
+      delay /= 2;
+    messageSize = size;
+    blockDelay = delay;
+  }
+
+  static File getTuningFile(){
+    return File::getSpecialLocation(File::userApplicationDataDirectory)
+      .getChildFile("FirmwareSender").getChildFile("tuning.json");
+  }
+
+  bool loadTuning(){
+    juce::var tuning = juce::JSON::parse(getTuningFile())[juce::Identifier(deviceName)];
+    if(!tuning.isObject())
+      return false;
+    if((int)tuning["size"] < MIN_MESSAGE_SIZE)
+      return false;
+    messageSize = tuning["size"];
+    blockDelay = tuning["delay"];
+    return true;
+  }
+
+  void saveTuning(){
+    File file = getTuningFile();
+    juce::var json = juce::JSON::parse(file);
+    if(!json.isObject())
+      json = new juce::DynamicObject();
+    juce::DynamicObject* tuning = new juce::DynamicObject();
+    tuning->setProperty("size", messageSize);
+    tuning->setProperty("delay", blockDelay);
+    json.getDynamicObject()->setProperty(juce::Identifier(deviceName), juce::var(tuning));
+    file.getParentDirectory().createDirectory();
+    file.replaceWithText(juce::JSON::toString(json));
+  }
+
+  /* calibrate, or use the cached tuning if cached; pacing the user gave
+   * is calibrated from instead, and not cached */
+  void tune(bool negotiate, bool cached){
+    if(cached && loadTuning()){
+      log.detail(deviceName + ": using tuning from " + getTuningFile().getFullPathName());
+    }else{
+      if(negotiate){
+	requestCapabilities();
+	if(waitForCapabilities(QUERY_TIMEOUT))
+	  messageSize = maxSysexSize;
+      }
+      log.status("calibrating " + deviceName);
+      calibrate();
+      if(cached)
+	saveTuning();
+    }
+    log.status(deviceName + ": sending " + juce::String(messageSize) + " byte messages every " +
+	       juce::String(blockDelay) + "ms");
+  }
+
+  uint32_t getMaxSysexSize() const {
+    return maxSysexSize;
+  }
+
+  void send(const uint8_t* data, int size){
+    log.detail("sending " + juce::String(size) + " bytes");
+    juce::MidiMessage msg = juce::MidiMessage::createSysExMessage(data, size);
+    ((uint8_t*)msg.getRawData())[2] = deviceNum; // F0, manufacturer, device
+    port->send(msg);
+  }
+
+  void begin(const juce::OwnedArray<FrameList>& encoded){
+    parts = &encoded;
+    part = 0;
+    frame = 0;
+    stored = 0;
+    waitStart = 0;
+    sentBytes = 0;
+    totalBytes = 0;
+    for(int p=0; p<encoded.size(); ++p)
+      for(int i=0; i<encoded[p]->size(); ++i)
+	totalBytes += (int)encoded[p]->getSize(i);
+    error = juce::String::empty;
+    startTime = due = juce::Time::getMillisecondCounterHiRes();
+  }
+
+  void start(const juce::OwnedArray<FrameList>& encoded){
+    begin(encoded);
+    startThread();
+  }
+
+  double getDue() const {
+    return due;
+  }
+
+  bool isFinished() const {
+    return part >= parts->size();
+  }
+
+  void cancel(){
+    if(!isFinished())
+      error = "cancelled";
+  }
+
+  /* in pipelined mode a part may only start while the device has a free
+   * buffer for it, and the upload is done once every part is stored */
+  bool isWaitingForStore() const {
+    int pending = part - stored.get(); // parts sent but not yet stored
+    if(isFinished())
+      return pending > 0;
+    return frame == 0 && pending >= partBuffers;
+  }
+
+  /* send the next message and schedule the one after it.
+   * Returns false once every part has been sent. */
+  bool step(){
+    while(!isFinished() && frame >= parts->getUnchecked(part)->size()){
+      part++;
+      frame = 0;
+    }
+    if(pipeline && isWaitingForStore()){
+      double now = juce::Time::getMillisecondCounterHiRes();
+      if(waitStart == 0)
+	waitStart = now;
+      if(now - waitStart > STORE_TIMEOUT){
+	error = "device did not acknowledge store";
+	part = parts->size();
+	endTime = now;
+	return false;
+      }
+      due = now + STORE_POLL;
+      return true;
+    }
+    waitStart = 0;
+    if(isFinished()){
+      endTime = juce::Time::getMillisecondCounterHiRes();
+      return false;
+    }
+    FrameList& frames = *parts->getUnchecked(part);
+    send(frames.getData(frame), frames.getSize(frame));
+    sentBytes += (int)frames.getSize(frame);
+    frame++;
+    due = juce::Time::getMillisecondCounterHiRes() + blockDelay;
+    return true;
+  }
+
+  void run(){
+    while(step()){
+      if(threadShouldExit()){
+	cancel();
+	return;
+      }
+      if(due > juce::Time::getMillisecondCounterHiRes())
+	juce::Time::waitForMillisecondCounter((uint32)due);
+    }
+  }
+
+  bool failed() const {
+    return error.isNotEmpty();
+  }
+
+  int getSentBytes() const {
+    return sentBytes.get();
+  }
+
+  int getTotalBytes() const {
+    return totalBytes;
+  }
+
+  const juce::String& getError() const {
+    return error;
+  }
+
+  double getElapsed() const {
+    return endTime - startTime;
+  }
+};
+
+/*
+ * Drives any number of upload targets from one thread. Each target is
+ * a resumable task that sends one message per step; the reactor always
+ * resumes the task whose pacing deadline comes first. Steps send with
+ * the blocking MidiOutput::sendMessageNow, so a port that stalls holds
+ * up every other target until it takes the message: use the reactor
+ * for ports that keep up, and a thread per target otherwise.
+ */
+class UploadReactor : public juce::Thread {
+private:
+  struct DueComparator {
+    static int compareElements(UploadTarget* a, UploadTarget* b){
+      return a->getDue() < b->getDue() ? -1 : a->getDue() > b->getDue() ? 1 : 0;
+    }
+  };
+  juce::Array<UploadTarget*> tasks; // sorted by due time
+public:
+  UploadReactor() : juce::Thread("UploadReactor") {}
+
+  ~UploadReactor(){
+    stopThread(-1);
+  }
+
+  void start(juce::OwnedArray<UploadTarget>& targets, const juce::OwnedArray<FrameList>& parts){
+    DueComparator comparator;
+    for(int i=0; i<targets.size(); ++i){
+      targets[i]->begin(parts);
+      tasks.addSorted(comparator, targets[i]);
+    }
+    startThread();
+  }
+
+  void run(){
+    DueComparator comparator;
+    while(!tasks.isEmpty() && !threadShouldExit()){
+      UploadTarget* task = tasks.removeAndReturn(0);
+      juce::Time::waitForMillisecondCounter((uint32)task->getDue());
+      if(task->step())
+	tasks.addSorted(comparator, task);
+    }
+    for(int i=0; i<tasks.size(); ++i)
+      tasks[i]->cancel();
+  }
+};
+
+/*
+ * Describes one upload: the data to send, the tail command for each
+ * input, where to send it and how fast. Jobs are move-only; submitting
+ * one hands it to the engine.
+ */
+class UploadJob {
+public:
+  enum Command { NONE, STORE, SAVE, RUN, FLASH };
+
+  /* one image, or one resource of a bank */
+  struct Input {
+    juce::File file;
+    const void* data = NULL; // span, kept alive by the caller until completion
+    size_t size = 0;
+    juce::ScopedPointer<juce::InputStream> stream;
+    FirmwareImage::Format format = FirmwareImage::BY_EXTENSION; // spans and streams are raw unless ELF
+    Command command = NONE;
+    int slot = 0;
+    juce::String name;
+    uint32_t checksum = 0;
+  };
+
+  struct Target {
+    juce::String port; // wildcard pattern
+    uint8_t deviceNum;
+  };
+
+  juce::OwnedArray<Input> inputs;
+  std::vector<Target> targets;
+  uint8_t deviceNum = MIDI_SYSEX_OMNI_DEVICE; // written to the SysEx file, targets patch in their own
+  int blockDelay = -1; // -1 for the default
+  int messageSize = 0; // 0 to ask the device
+  bool autoTune = false; // calibrate pacing, cached per device
+  bool useReactor = false; // drive all targets from one thread
+  bool pipeline = false; // send the next part while the device stores the last
+  bool sparse = false; // send runs of 0x00 or 0xff as fill commands
+  uint32_t partSize = 0; // split a single input into parts of this size
+  uint32_t slotSize = DEFAULT_SLOT_SIZE;
+  juce::File delta; // installed image, only send blocks that differ
+  juce::File sysexFile; // also write the encoded upload here
+  juce::MemoryBlock* sysexData = NULL; // or append it here, kept alive by the caller
+  UploadLog log;
+  std::function<void(const juce::String& device, int sent, int total)> onProgress;
+
+  UploadJob() {}
+  UploadJob(UploadJob&&) = default;
+  UploadJob& operator=(UploadJob&&) = default;
+  UploadJob(const UploadJob&) = delete;
+  UploadJob& operator=(const UploadJob&) = delete;
+
+  UploadJob& addFile(const juce::File& file, FirmwareImage::Format format = FirmwareImage::BY_EXTENSION){
+    Input* input = inputs.add(new Input());
+    input->file = file;
+    input->format = format;
+    return *this;
+  }
+
+  UploadJob& addSpan(const void* data, size_t size){
+    Input* input = inputs.add(new Input());
+    input->data = data;
+    input->size = size;
+    return *this;
+  }
+
+  /* takes ownership of the stream */
+  UploadJob& addStream(juce::InputStream* stream){
+    inputs.add(new Input())->stream = stream;
+    return *this;
+  }
+
+  /* tail commands apply to the last input added */
+  UploadJob& store(int slot){
+    getLastInput().command = STORE;
+    getLastInput().slot = slot;
+    return *this;
+  }
+
+  UploadJob& save(const juce::String& name){
+    getLastInput().command = SAVE;
+    getLastInput().name = name;
+    return *this;
+  }
+
+  UploadJob& run(){
+    getLastInput().command = RUN;
+    return *this;
+  }
+
+  UploadJob& flash(uint32_t checksum){
+    getLastInput().command = FLASH;
+    getLastInput().checksum = checksum;
+    return *this;
+  }
+
+  UploadJob& addTarget(const juce::String& port, uint8_t deviceNum = MIDI_SYSEX_OMNI_DEVICE){
+    Target target = { port, deviceNum };
+    targets.push_back(target);
+    return *this;
+  }
+
+private:
+  Input& getLastInput(){
+    if(inputs.isEmpty())
+      throw UploadException("Tail command without an input");
+    return *inputs.getLast();
+  }
+};
+
+struct UploadResult {
+  struct TargetResult {
+    juce::String device;
+    uint8_t deviceNum;
+    juce::String error; // empty on success
+    double milliseconds;
+  };
+  juce::String error; // why the job as a whole failed, empty otherwise
+  std::vector<TargetResult> targets;
+
+  bool failed() const {
+    if(error.isNotEmpty())
+      return true;
+    for(size_t i=0; i<targets.size(); ++i)
+      if(targets[i].error.isNotEmpty())
+	return true;
+    return false;
+  }
+};
+
+/*
+ * Runs one job: encodes every part once on all cores, then streams the
+ * parts to each target with its own pacing. Jobs sharing a port take
+ * turns on it in the order they started.
+ */
+class UploadSession {
+private:
+  UploadJob job;
+  const UploadLog& log;
+  juce::Atomic<int> running; // cleared by cancel(), from any thread
+  juce::OwnedArray<UploadTarget> targets;
+  juce::ScopedPointer<UploadReactor> reactor;
+  juce::ReferenceCountedArray<MidiPort> ports; // outlive the targets, which end their turns after stopping
+  juce::Array<int> tickets;
+  int blockSize = DEFAULT_BLOCK_SIZE;
+  // every part encoded once, for all targets
+  juce::OwnedArray<FirmwareImage> images;
+  juce::OwnedArray<FrameList> parts;
+  juce::OwnedArray<EncodeJob> jobs;
+  juce::Array<int> partJobs; // index of the first job of each part
+  juce::Array<const UploadJob::Input*> partTails;
+  juce::Array<int> partSlots;
+
+  static juce::CriticalSection& getTicketLock(){
+    static juce::CriticalSection lock;
+    return lock;
+  }
+
+public:
+  UploadSession(UploadJob&& j) : job(std::move(j)), log(job.log), running(1) {}
+
+  ~UploadSession(){
+    cancel();
+    reactor = NULL;
+    targets.clear();
+    for(int i=0; i<tickets.size(); ++i)
+      ports[i]->endTurn(tickets[i]);
+  }
+
+  void cancel(){
+    running = 0;
+    if(reactor != NULL)
+      reactor->signalThreadShouldExit();
+    for(int i=0; i<targets.size(); ++i)
+      targets[i]->signalThreadShouldExit();
+  }
+
+  UploadResult run(){
+    UploadResult result;
+    try{
+      validate();
+      openTargets();
+      if(job.messageSize > 0)
+	blockSize = job.messageSize - MESSAGE_SIZE;
+      if(!targets.isEmpty())
+	configureTargets();
+      encodeInputs();
+      if(job.sysexFile != juce::File())
+	save();
+      if(job.sysexData != NULL){
+	juce::MemoryOutputStream out(*job.sysexData, true);
+	for(int p=0; p<parts.size(); ++p)
+	  write(out, *parts[p]);
+      }
+      send();
+      for(int i=0; i<targets.size(); ++i){
+	UploadResult::TargetResult tr = { targets[i]->getDeviceName(), targets[i]->deviceNum,
+					  targets[i]->getError(), targets[i]->getElapsed() };
+	result.targets.push_back(tr);
+      }
+      if(!running.get() && result.targets.empty())
+	result.error = "cancelled";
+    }catch(const UploadException& exc){
+      result.error = exc.getCause();
+    }
+    return result;
+  }
+
+private:
+  void validate(){
+    if(job.inputs.isEmpty())
+      throw UploadException("No input");
+    if(job.messageSize > 0 && job.messageSize < MIN_MESSAGE_SIZE)
+      throw UploadException("SysEx messages must be at least " + juce::String(MIN_MESSAGE_SIZE) + " bytes");
+    if(job.inputs.size() > 1 && (job.partSize || job.delta != juce::File()))
+      throw UploadException("Several inputs cannot be split or sent as a delta");
+    if(job.delta != juce::File() && job.partSize)
+      throw UploadException("A delta upload cannot be split");
+    if(job.autoTune && job.targets.empty())
+      throw UploadException("Tuning needs a MIDI output");
+    if(job.pipeline && job.partSize == 0 && job.inputs.size() < 2)
+      throw UploadException("Pipelining needs several parts");
+  }
+
+  void openTargets(){
+    for(size_t i=0; i<job.targets.size(); ++i){
+      UploadTarget* target = UploadTarget::open(job.targets[i].port, job.targets[i].deviceNum, log);
+      if(target == NULL)
+	throw UploadException("MIDI device not available: "+job.targets[i].port);
+      targets.add(target);
+      ports.addIfNotAlreadyThere(target->getPort());
+    }
+    for(int i=0; i<targets.size(); ++i)
+      for(int j=0; j<targets.size(); ++j)
+	if(i != j && targets[i]->getPort() == targets[j]->getPort())
+	  targets[i]->sharedPort = true;
+    {
+      // take all tickets at once, so jobs sharing ports queue in one order
+      const ScopedLock sl(getTicketLock());
+      for(int i=0; i<ports.size(); ++i)
+	tickets.add(ports[i]->takeTicket());
+    }
+    for(int i=0; i<ports.size(); ++i)
+      if(!ports[i]->waitForTurn(tickets[i], running))
+	throw UploadException("cancelled");
+  }
+
+  /* settle pacing per target; the block size is shared, so use the smallest */
+  void configureTargets(){
+    bool autoSize = job.messageSize <= 0;
+    bool autoDelay = job.blockDelay < 0;
+    for(int i=0; i<targets.size(); ++i){
+      targets[i]->blockDelay = autoDelay ? DEFAULT_BLOCK_DELAY : job.blockDelay;
+      targets[i]->messageSize = blockSize + MESSAGE_SIZE;
+      targets[i]->pipeline = job.pipeline;
+      if(job.pipeline && !targets[i]->getPort()->hasInput())
+	throw UploadException("Pipelining needs a MIDI input for device replies: "+targets[i]->getDeviceName());
+      if(job.pipeline && targets[i]->sharedPort && targets[i]->deviceNum == MIDI_SYSEX_OMNI_DEVICE)
+	throw UploadException("Pipelining several devices on one port needs an -id for each: "+targets[i]->getDeviceName());
+    }
+    if(job.autoTune){
+      for(int i=0; i<targets.size() && running.get(); ++i)
+	targets[i]->tune(autoSize, autoSize && autoDelay);
+    }
+    if((autoSize && !job.autoTune) || job.pipeline){
+      // query in parallel, pipelining also needs the number of part buffers
+      for(int i=0; i<targets.size(); ++i)
+	targets[i]->requestCapabilities();
+      uint32_t deadline = juce::Time::getMillisecondCounter()+QUERY_TIMEOUT;
+      for(int i=0; i<targets.size(); ++i){
+	if(targets[i]->waitForCapabilities(deadline - juce::Time::getMillisecondCounter()) && autoSize && !job.autoTune)
+	  targets[i]->messageSize = targets[i]->getMaxSysexSize();
+      }
+    }
+    blockSize = targets[0]->messageSize - MESSAGE_SIZE;
+    for(int i=1; i<targets.size(); ++i)
+      blockSize = std::min(blockSize, targets[i]->messageSize - MESSAGE_SIZE);
+  }
+
+  void loadImage(const UploadJob::Input& input, FirmwareImage& image){
+    juce::Result result = juce::Result::ok();
+    FirmwareImage::Format format = input.format == FirmwareImage::ELF ? FirmwareImage::ELF : FirmwareImage::BINARY;
+    if(input.data != NULL){
+      result = image.load(input.data, input.size, format);
+    }else if(input.stream != NULL){
+      juce::MemoryBlock data;
+      input.stream->readIntoMemoryBlock(data);
+      result = image.load(data.getData(), data.getSize(), format);
+    }else{
+      result = image.load(input.file, input.format);
+      if(result.wasOk() && image.isSparse())
+	log.status(input.file.getFileName() + " at 0x" + juce::String::toHexString((int)image.getBaseAddress()) +
+		   ", " + juce::String(image.getSize()) + " bytes");
+    }
+    if(result.failed())
+      throw UploadException(result.getErrorMessage());
+  }
+
+  void encodeInputs(){
+    FirmwareImage baseImage;
+    if(job.delta != juce::File()){
+      UploadJob::Input base;
+      base.file = job.delta;
+      loadImage(base, baseImage);
+    }
+    if(job.inputs.size() == 1){
+      FirmwareImage& image = *images.add(new FirmwareImage());
+      const UploadJob::Input& input = *job.inputs[0];
+      loadImage(input, image);
+      int size = image.getSize(); // amount of data, excluding checksum
+      int start = 0;
+      for(int p=0; job.partSize && size-start > (int)job.partSize; ++p){
+	addPart(image, baseImage, start, job.partSize, input, getPartSlot(input, p));
+	start += job.partSize;
+      }
+      addPart(image, baseImage, start, size-start, input, getPartSlot(input, parts.size()));
+    }else{
+      // one part per resource, all encoded up front and sent back to back
+      for(int i=0; i<job.inputs.size() && running.get(); ++i){
+	FirmwareImage& image = *images.add(new FirmwareImage());
+	loadImage(*job.inputs[i], image);
+	addPart(image, baseImage, 0, image.getSize(), *job.inputs[i], job.inputs[i]->slot);
+      }
+    }
+    for(int p=0; p<parts.size() && job.pipeline; ++p)
+      if(partTails[p]->command != UploadJob::STORE)
+	throw UploadException("Pipelining needs every part to be stored");
+    partJobs.add(jobs.size());
+    encode();
+    for(int p=0; p<parts.size() && running.get(); ++p)
+      finishPart(*parts[p], partJobs[p], partJobs[p+1], *partTails[p], partSlots[p]);
+  }
+
+  /* split parts go to consecutive slots of slotSize each */
+  int getPartSlot(const UploadJob::Input& input, int part){
+    return input.slot + part*(job.partSize/job.slotSize);
+  }
+
+  void addPart(const FirmwareImage& image, const FirmwareImage& baseImage, int start, int size,
+	       const UploadJob::Input& tail, int slot){
+    partJobs.add(jobs.size());
+    partTails.add(&tail);
+    partSlots.add(slot);
+    planPart(image, baseImage, start, size, *parts.add(new FrameList()));
+  }
+
+  void save(){
+    juce::File file = job.sysexFile;
+    for(int p=0; p<parts.size(); ++p){
+      if(p > 0){
+	file = file.getNonexistentSibling();
+	log.status("\tto SysEx file " + file.getFullPathName());
+      }
+      file.deleteFile();
+      file.create();
+      juce::ScopedPointer<OutputStream> out = file.createOutputStream();
+      if(out == NULL)
+	throw UploadException("Cannot write "+file.getFullPathName());
+      write(*out, *parts[p]);
+      out->flush();
+    }
+  }
+
+  void write(juce::OutputStream& out, const FrameList& frames){
+    for(int i=0; i<frames.size(); ++i){
+      out.writeByte(SYSEX);
+      out.write(frames.getData(i), frames.getSize(i));
+      out.writeByte(SYSEX_EOX);
+    }
+  }
+
+  void send(){
+    if(job.useReactor && running.get()){
+      reactor = new UploadReactor();
+      reactor->start(targets, parts);
+      waitFor(reactor);
+    }else{
+      for(int i=0; i<targets.size() && running.get(); ++i)
+	targets[i]->start(parts);
+    }
+    for(int i=0; i<targets.size(); ++i)
+      waitFor(targets[i]);
+  }
+
+  /* wait for a sending thread, reporting progress as it goes */
+  void waitFor(juce::Thread* thread){
+    if(!job.onProgress){
+      thread->waitForThreadToExit(-1);
+      return;
+    }
+    while(!thread->waitForThreadToExit(PROGRESS_INTERVAL)){
+      for(int i=0; i<targets.size(); ++i)
+	job.onProgress(targets[i]->getDeviceName(), targets[i]->getSentBytes(), targets[i]->getTotalBytes());
+    }
+  }
+
+  /* run the encode jobs of all parts across the available cores */
+  void encode(){
+    if(jobs.size() < 2){
+      for(int i=0; i<jobs.size(); ++i)
+	jobs[i]->runJob();
+      return;
+    }
+    juce::ThreadPool pool(juce::SystemStats::getNumCpus());
+    for(int i=0; i<jobs.size(); ++i)
+      pool.addJob(jobs[i], false);
+    for(int i=0; i<jobs.size(); ++i)
+      pool.waitForJobToFinish(jobs[i], -1);
+  }
+
+  void addPackage(FrameList& frames, const uint8_t* buffer, uint8_t command, int offset, int length, int payload){
+    if(jobs.getLast()->size() == JOB_PACKAGES)
+      jobs.add(new EncodeJob(buffer, frames, job.deviceNum));
+    Package package = { command, offset, length, frames.allocate(MESSAGE_SIZE+payload) };
+    jobs.getLast()->add(package);
+  }
+
+  /* lay out the messages of one part and queue the jobs that encode them */
+  void planPart(const FirmwareImage& image, const FirmwareImage& baseImage, int start, int size, FrameList& frames){
+    log.detail("encoding " + juce::String(size) + " bytes");
+
+    const uint8_t header[] =  { MIDI_SYSEX_MANUFACTURER, job.deviceNum, SYSEX_FIRMWARE_UPLOAD };
+    int binblock = (int)floor(blockSize*7/8);
+
+    const uint8_t* buffer = image.getData() + start;
+
+    frames.reserve(MESSAGE_SIZE*((size_t)size/binblock+4) + sysexLength(size));
+    MemoryBlock block;
+    block.append(header, sizeof(header));
+    encodeInt(block, 0);
+    encodeInt(block, size);
+    // first message with index and length
+    frames.add(block);
+
+    int firstJob = jobs.size();
+    jobs.add(new EncodeJob(buffer, frames, job.deviceNum)); // jobs never span parts
+    int unchanged = 0;
+    int filled = 0;
+    int skipped = 0;
+    for(int i=0; i < size && running.get();){
+      int next = image.nextPopulated(start+i, start+size) - start;
+      if(next > i){
+	// gap between segments: the device skips ahead, leaving erased flash
+	addPackage(frames, buffer, SYSEX_FIRMWARE_OFFSET, i, next-i, 5);
+	skipped += next-i;
+	i = next;
+	log.detail("skipping to offset " + juce::String(i) + " of " + juce::String(size) + " bytes");
+	continue;
+      }
+      int copy = 0;
+      while(i%binblock == 0 && i+copy < size){
+	// compare the bytes themselves, the upload checksum cannot tell blocks apart
+	int at = i+copy;
+	int n = std::min(binblock, size-at);
+	if(at+n > baseImage.getSize() || memcmp(baseImage.getData()+at, buffer+at, n) != 0)
+	  break;
+	copy += n;
+      }
+      if(copy > 0){
+	// unchanged blocks: device keeps them from the installed image
+	addPackage(frames, buffer, SYSEX_FIRMWARE_COPY, i, copy, 5);
+	i += copy;
+	unchanged += copy;
+	log.detail("keeping " + juce::String(copy) + " bytes (total " + juce::String(i) + " of " +
+		   juce::String(size) + " bytes)");
+	continue;
+      }
+      int fill = 0;
+      if(job.sparse && (buffer[i] == 0x00 || buffer[i] == 0xff)){
+	fill = fillRunLength(buffer+i, size-i, buffer[i]);
+	if(i+fill < size)
+	  fill -= (i+fill) % binblock; // end on a block boundary, keeps delta blocks aligned
+      }
+      if(fill > 0){
+	addPackage(frames, buffer, SYSEX_FIRMWARE_FILL, i, fill, 10);
+	i += fill;
+	filled += fill;
+	log.detail("filling " + juce::String(fill) + " bytes (total " + juce::String(i) + " of " +
+		   juce::String(size) + " bytes)");
+	continue;
+      }
+      int end = std::min(image.endOfPopulated(start+i) - start, size);
+      int len = std::min(binblock - i%binblock, end-i);
+      addPackage(frames, buffer, SYSEX_FIRMWARE_UPLOAD, i, len, sysexLength(len));
+      i += len;
+    }
+    log.detail("planned " + juce::String(frames.size()) + " messages in " + juce::String(jobs.size()-firstJob) + " jobs");
+    if(job.delta != juce::File())
+      log.status("delta: kept " + juce::String(unchanged) + " of " + juce::String(size) + " bytes");
+    if(skipped > 0)
+      log.status("skipped " + juce::String(skipped) + " of " + juce::String(size) + " bytes");
+    if(job.sparse)
+      log.status("sparse: filled " + juce::String(filled) + " of " + juce::String(size) + " bytes");
+  }
+
+  /* add the checksum and command messages once a part is encoded */
+  void finishPart(FrameList& frames, int firstJob, int lastJob, const UploadJob::Input& tail, int slot){
+    uint32_t checksum = 0;
+    for(int i=firstJob; i<lastJob; ++i)
+      checksum = crc32_combine(checksum, jobs[i]->crc, jobs[i]->length);
+
+    // last block: package index and checksum
+    const uint8_t header[] =  { MIDI_SYSEX_MANUFACTURER, job.deviceNum, SYSEX_FIRMWARE_UPLOAD };
+    MemoryBlock block;
+    block.append(header, sizeof(header));
+    encodeInt(block, frames.size());
+    encodeInt(block, checksum);
+    frames.add(block);
+
+    log.status("checksum 0x" + juce::String::toHexString((int)checksum));
+
+    uint8_t command;
+    switch(tail.command){
+    case UploadJob::STORE:
+      command = SYSEX_FIRMWARE_STORE;
+      log.status("store slot " + juce::String::toHexString(slot));
+      break;
+    case UploadJob::SAVE:
+      command = SYSEX_FIRMWARE_SAVE;
+      log.status("Saving resource with name: " + tail.name);
+      break;
+    case UploadJob::RUN:
+      command = SYSEX_FIRMWARE_RUN;
+      break;
+    case UploadJob::FLASH:
+      command = SYSEX_FIRMWARE_FLASH;
+      break;
+    default:
+      return;
+    }
+    const uint8_t tailer[] =  { MIDI_SYSEX_MANUFACTURER, job.deviceNum, command };
+    block = MemoryBlock();
+    block.append(tailer, sizeof(tailer));
+    if(tail.command == UploadJob::STORE)
+      encodeInt(block, slot);
+    else if(tail.command == UploadJob::SAVE)
+      block.append(tail.name.toUTF8(), tail.name.getNumBytesAsUTF8()+1); // include trailing \0
+    else if(tail.command == UploadJob::FLASH)
+      encodeInt(block, tail.checksum);
+    frames.add(block);
+  }
+};
+
+/*
+ * Runs upload jobs for an application: synchronously with run(), or in
+ * the background with submit(), which completes a future or calls back
+ * on the upload thread. Ports can be kept open between jobs.
+ */
+class UploadEngine {
+public:
+  typedef std::function<void(const UploadResult&)> Callback;
+
+private:
+  class Worker : public juce::Thread {
+  private:
+    UploadEngine& engine;
+    UploadJob job;
+    Callback done;
+  public:
+    Worker(UploadEngine& e, UploadJob&& j, Callback cb)
+      : juce::Thread("UploadWorker"), engine(e), job(std::move(j)), done(cb) {}
+
+    ~Worker(){
+      stopThread(-1);
+    }
+
+    void run(){
+      UploadResult result = engine.run(std::move(job));
+      if(done)
+	done(result);
+    }
+  };
+
+  juce::CriticalSection lock;
+  juce::Array<UploadSession*> sessions;
+  juce::OwnedArray<Worker> workers;
+  bool keepPortsOpen;
+
+public:
+  UploadEngine(bool keepOpen = false) : keepPortsOpen(keepOpen) {
+    if(keepPortsOpen)
+      MidiPort::getCache().enabled = true;
+  }
+
+  ~UploadEngine(){
+    cancelAll();
+    workers.clear();
+    if(keepPortsOpen){
+      MidiPort::Cache& cache = MidiPort::getCache();
+      const ScopedLock sl(cache.lock);
+      cache.ports.clear();
+    }
+  }
+
+  /* run a job on the calling thread */
+  UploadResult run(UploadJob&& job){
+    UploadSession session(std::move(job));
+    {
+      const ScopedLock sl(lock);
+      sessions.add(&session);
+    }
+    UploadResult result = session.run();
+    {
+      const ScopedLock sl(lock);
+      sessions.removeFirstMatchingValue(&session);
+    }
+    return result;
+  }
+
+  /* run a job in the background, calling done from its thread when finished */
+  void submit(UploadJob&& job, Callback done){
+    const ScopedLock sl(lock);
+    for(int i=workers.size(); --i >= 0;)
+      if(!workers[i]->isThreadRunning())
+	workers.remove(i);
+    workers.add(new Worker(*this, std::move(job), done))->startThread();
+  }
+
+  std::future<UploadResult> submit(UploadJob&& job){
+    std::shared_ptr<std::promise<UploadResult> > promise(new std::promise<UploadResult>());
+    std::future<UploadResult> future = promise->get_future();
+    submit(std::move(job), [promise](const UploadResult& result){ promise->set_value(result); });
+    return future;
+  }
+
+  /* stop every job in progress, their results report the cancellation */
+  void cancelAll(){
+    const ScopedLock sl(lock);
+    for(int i=0; i<sessions.size(); ++i)
+      sessions[i]->cancel();
+  }
+};
+
+#endif // __UploadEngine_H__
@@ -9,6 +9,8 @@
 #endif
 
    uint32_t crc32(const void *buf, size_t size, uint32_t crc);
+   /* checksum of two concatenated blocks from their checksums and the second length */
+   uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,234 @@
+/*
+  C interface to the upload engine and loader, see owlsysex.h. Build
+  with Builds/Linux/libowlsysex.mk.
+*/
+#include <stdlib.h>
+#include <string>
+#include "owlsysex.h"
+#include "UploadEngine.hpp"
+
+#define NO_ERROR         0x00
+#define PROGRAM_ERROR    0x60
+#define MAX_SYSEX_PAYLOAD_SIZE (8*1024*1024)
+
+static thread_local std::string lastError;
+
+static void setLastError(const juce::String& msg){
+  lastError = msg.toStdString();
+}
+
+/* FirmwareLoader reports through these, as it does on the device */
+void error(int8_t code, const char* reason){
+  setLastError(reason);
+}
+
+void setErrorStatus(int8_t err){}
+
+#include "LoaderStorage.hpp"
+
+/* each loader receives into its own buffer, preset with the base image */
+struct owl_loader : public BasicFirmwareLoader<RamStorage> {};
+
+/* ports stay open between uploads until the library is unloaded */
+static UploadEngine& getEngine(){
+  static UploadEngine engine(true);
+  return engine;
+}
+
+static UploadJob makeJob(const uint8_t* data, size_t size, const owl_upload_options* options){
+  owl_upload_options defaults;
+  if(options == NULL){
+    owl_upload_defaults(&defaults);
+    options = &defaults;
+  }
+  UploadJob job;
+  job.addSpan(data, size);
+  switch(options->command){
+  case OWL_COMMAND_STORE:
+    job.store(options->slot);
+    break;
+  case OWL_COMMAND_SAVE:
+    job.save(juce::String::fromUTF8(options->name != NULL ? options->name : ""));
+    break;
+  case OWL_COMMAND_RUN:
+    job.run();
+    break;
+  case OWL_COMMAND_FLASH:
+    job.flash(options->checksum);
+    break;
+  }
+  job.deviceNum = options->device;
+  job.messageSize = options->message_size;
+  job.blockDelay = options->delay;
+  job.sparse = options->sparse != 0;
+  if(options->progress != NULL){
+    owl_progress_fn progress = options->progress;
+    void* context = options->context;
+    job.onProgress = [progress, context](const juce::String&, int sent, int total){
+      progress(context, sent, total);
+    };
+  }
+  return job;
+}
+
+/* the first error of a result, or an empty string */
+static juce::String getError(const UploadResult& result){
+  if(result.error.isNotEmpty())
+    return result.error;
+  for(size_t i=0; i<result.targets.size(); ++i)
+    if(result.targets[i].error.isNotEmpty())
+      return result.targets[i].device + ": " + result.targets[i].error;
+  return juce::String::empty;
+}
+
+int owl_abi_version(void){
+  return OWL_ABI_VERSION;
+}
+
+const char* owl_last_error(void){
+  return lastError.c_str();
+}
+
+size_t owl_sysex_length(size_t len){
+  return sysexLength(len);
+}
+
+size_t owl_encode(const uint8_t* data, size_t len, uint8_t* sysex){
+  return data_to_sysex((uint8_t*)data, sysex, len);
+}
+
+size_t owl_decode(const uint8_t* sysex, size_t len, uint8_t* data){
+  return sysex_to_data((uint8_t*)sysex, data, len);
+}
+
+uint32_t owl_crc32(const void* data, size_t size, uint32_t crc){
+  return crc32(data, size, crc);
+}
+
+size_t owl_frame_length(size_t len){
+  return 1+MESSAGE_SIZE+sysexLength(len)+1;
+}
+
+size_t owl_frame(uint8_t device, uint8_t command, uint32_t index,
+		 const uint8_t* payload, size_t len, uint8_t* frame){
+  frame[0] = SYSEX;
+  frame[1] = MIDI_SYSEX_MANUFACTURER;
+  frame[2] = device;
+  frame[3] = command;
+  encodeInt(frame+4, index);
+  size_t size = 1+MESSAGE_SIZE+data_to_sysex((uint8_t*)payload, frame+1+MESSAGE_SIZE, len);
+  frame[size] = SYSEX_EOX;
+  return size+1;
+}
+
+void owl_upload_defaults(owl_upload_options* options){
+  memset(options, 0, sizeof(owl_upload_options));
+  options->device = MIDI_SYSEX_OMNI_DEVICE;
+  options->delay = DEFAULT_BLOCK_DELAY;
+  options->command = OWL_COMMAND_NONE;
+}
+
+uint8_t* owl_encode_upload(const uint8_t* data, size_t size,
+			   const owl_upload_options* options, size_t* length){
+  try{
+    juce::MemoryBlock block;
+    UploadJob job = makeJob(data, size, options);
+    job.sysexData = &block;
+    UploadResult result = UploadSession(std::move(job)).run();
+    if(result.failed()){
+      setLastError(getError(result));
+      return NULL;
+    }
+    uint8_t* encoded = (uint8_t*)malloc(block.getSize());
+    if(encoded == NULL){
+      setLastError("Out of memory");
+      return NULL;
+    }
+    memcpy(encoded, block.getData(), block.getSize());
+    *length = block.getSize();
+    return encoded;
+  }catch(const std::exception& exc){
+    setLastError(exc.what());
+    return NULL;
+  }
+}
+
+int owl_upload(const uint8_t* data, size_t size, const char* port,
+	       const owl_upload_options* options){
+  try{
+    UploadJob job = makeJob(data, size, options);
+    job.addTarget(juce::String::fromUTF8(port), job.deviceNum);
+    UploadResult result = getEngine().run(std::move(job));
+    if(result.failed()){
+      setLastError(getError(result));
+      return -1;
+    }
+    return 0;
+  }catch(const std::exception& exc){
+    setLastError(exc.what());
+    return -1;
+  }
+}
+
+void owl_cancel(void){
+  getEngine().cancelAll();
+}
+
+void owl_free(void* data){
+  free(data);
+}
+
+owl_loader* owl_loader_new(void){
+  owl_loader* loader = new owl_loader();
+  loader->clear();
+  return loader;
+}
+
+void owl_loader_free(owl_loader* loader){
+  delete loader;
+}
+
+int owl_loader_set_base(owl_loader* loader, const uint8_t* data, size_t size){
+  if(size > MAX_SYSEX_PAYLOAD_SIZE){
+    setLastError("Base image too big");
+    return -1;
+  }
+  loader->storage.setBase(data, size);
+  return 0;
+}
+
+int owl_loader_receive(owl_loader* loader, const uint8_t* message, size_t len){
+  if(len > 0 && message[0] == SYSEX){
+    message++;
+    len--;
+  }
+  if(len > 0 && message[len-1] == SYSEX_EOX)
+    len--;
+  if(len < 3 || message[0] != MIDI_SYSEX_MANUFACTURER)
+    return OWL_LOADER_OTHER;
+  uint8_t command = message[2];
+  if(command != SYSEX_FIRMWARE_UPLOAD && command != SYSEX_FIRMWARE_COPY &&
+     command != SYSEX_FIRMWARE_FILL && command != SYSEX_FIRMWARE_OFFSET)
+    return OWL_LOADER_OTHER;
+  if(len < MESSAGE_SIZE){
+    setLastError("Invalid SysEx package");
+    return OWL_LOADER_ERROR;
+  }
+  int32_t ret = loader->handleFirmwareUpload((uint8_t*)message, len);
+  if(ret < 0)
+    return OWL_LOADER_ERROR;
+  return ret > 0 ? OWL_LOADER_DONE : OWL_LOADER_MORE;
+}
+
+const uint8_t* owl_loader_data(owl_loader* loader, size_t* size){
+  if(!loader->isReady()){
+    setLastError("Upload not complete");
+    return NULL;
+  }
+  *size = loader->getDataSize();
+  return loader->getData();
+}
+
+uint32_t owl_loader_checksum(owl_loader* loader){
+  return loader->getChecksum();
+}
@@ -0,0 +1,98 @@
+#ifndef __OWLSYSEX_H
+#define __OWLSYSEX_H
+
+/*
+ * C interface to the OWL SysEx encoder, loader and MIDI upload, built
+ * as libowlsysex by Builds/Linux/libowlsysex.mk. Functions that can
+ * fail return a negative value or NULL and leave a message for
+ * owl_last_error().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined _WIN32
+#define OWL_API __declspec(dllexport)
+#else
+#define OWL_API __attribute__((visibility("default")))
+#endif
+
+#define OWL_ABI_VERSION 1
+
+#define OWL_OMNI_DEVICE 0x52
+
+/* tail commands sent after an upload */
+#define OWL_COMMAND_NONE  0
+#define OWL_COMMAND_STORE 1
+#define OWL_COMMAND_SAVE  2
+#define OWL_COMMAND_RUN   3
+#define OWL_COMMAND_FLASH 4
+
+/* owl_loader_receive() results */
+#define OWL_LOADER_ERROR -1
+#define OWL_LOADER_MORE   0
+#define OWL_LOADER_DONE   1
+#define OWL_LOADER_OTHER  2 /* not an upload message, ignored */
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+   typedef void (*owl_progress_fn)(void* context, int sent, int total);
+
+   typedef struct {
+     uint8_t device;       /* device id, OWL_OMNI_DEVICE for any */
+     int message_size;     /* largest SysEx message, 0 to ask the device */
+     int delay;            /* milliseconds between messages */
+     int sparse;           /* send runs of 0x00 or 0xff as fill commands */
+     int command;          /* OWL_COMMAND_* */
+     int slot;             /* for OWL_COMMAND_STORE */
+     const char* name;     /* for OWL_COMMAND_SAVE */
+     uint32_t checksum;    /* for OWL_COMMAND_FLASH */
+     owl_progress_fn progress; /* optional, called from the calling thread */
+     void* context;
+   } owl_upload_options;
+
+   typedef struct owl_loader owl_loader;
+
+   OWL_API int owl_abi_version(void);
+   /* why the last call on this thread failed */
+   OWL_API const char* owl_last_error(void);
+
+   /* 7-bit SysEx packing, owl_encode() writes exactly owl_sysex_length(len) bytes */
+   OWL_API size_t owl_sysex_length(size_t len);
+   OWL_API size_t owl_encode(const uint8_t* data, size_t len, uint8_t* sysex);
+   OWL_API size_t owl_decode(const uint8_t* sysex, size_t len, uint8_t* data);
+   OWL_API uint32_t owl_crc32(const void* data, size_t size, uint32_t crc);
+
+   /* one upload package, F0 to F7, into frame of owl_frame_length(len) bytes */
+   OWL_API size_t owl_frame_length(size_t len);
+   OWL_API size_t owl_frame(uint8_t device, uint8_t command, uint32_t index,
+			    const uint8_t* payload, size_t len, uint8_t* frame);
+
+   OWL_API void owl_upload_defaults(owl_upload_options* options);
+   /* a complete upload as SysEx messages, release with owl_free() */
+   OWL_API uint8_t* owl_encode_upload(const uint8_t* data, size_t size,
+				      const owl_upload_options* options, size_t* length);
+   /* send data to the MIDI output matching port, 0 on success */
+   OWL_API int owl_upload(const uint8_t* data, size_t size, const char* port,
+			  const owl_upload_options* options);
+   /* stop uploads in progress on other threads */
+   OWL_API void owl_cancel(void);
+   OWL_API void owl_free(void* data);
+
+   /* reassemble an upload from its SysEx messages */
+   OWL_API owl_loader* owl_loader_new(void);
+   OWL_API void owl_loader_free(owl_loader* loader);
+   /* installed image that copy packages of a delta upload refer to */
+   OWL_API int owl_loader_set_base(owl_loader* loader, const uint8_t* data, size_t size);
+   /* one message, with or without F0 and F7, returns OWL_LOADER_* */
+   OWL_API int owl_loader_receive(owl_loader* loader, const uint8_t* message, size_t len);
+   OWL_API const uint8_t* owl_loader_data(owl_loader* loader, size_t* size);
+   OWL_API uint32_t owl_loader_checksum(owl_loader* loader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OWLSYSEX_H */
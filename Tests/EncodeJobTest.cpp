@@ -0,0 +1,53 @@
+#include "UploadEngine.hpp"
+#include "TestMain.h"
+
+/* full blocks are a multiple of seven bytes, so they fill their last group */
+static void testEncodeStaysInBounds(){
+  uint8_t data[14];
+  for(int i=0; i<14; ++i)
+    data[i] = 0x80 + i;
+  uint8_t sysex[17];
+  memset(sysex, 0xaa, sizeof(sysex));
+  CHECK(data_to_sysex(data, sysex, 14) == 16);
+  CHECK(sysex[16] == 0xaa);
+  CHECK(data_to_sysex(data, sysex+16, 0) == 0);
+  CHECK(sysex[16] == 0xaa);
+  uint8_t decoded[14];
+  CHECK(sysex_to_data(sysex, decoded, 16) == 14);
+  CHECK(memcmp(data, decoded, 14) == 0);
+}
+
+/* frames are packed back to back, jobs must not touch each other's */
+static void testJobsOutOfOrder(){
+  const int binblock = 210;
+  const int count = 4;
+  uint8_t data[binblock*count];
+  for(int i=0; i<(int)sizeof(data); ++i)
+    data[i] = (uint8_t)(i*37);
+  FrameList frames;
+  EncodeJob first(data, frames, MIDI_SYSEX_OMNI_DEVICE);
+  EncodeJob second(data, frames, MIDI_SYSEX_OMNI_DEVICE);
+  for(int i=0; i<count; ++i){
+    Package package = { SYSEX_FIRMWARE_UPLOAD, i*binblock, binblock,
+			frames.allocate(MESSAGE_SIZE+sysexLength(binblock)) };
+    (i < count/2 ? first : second).add(package);
+  }
+  second.runJob();
+  first.runJob();
+  for(int i=0; i<count; ++i){
+    uint8_t* msg = frames.getData(i);
+    CHECK(frames.getSize(i) == MESSAGE_SIZE+sysexLength(binblock));
+    CHECK(msg[0] == MIDI_SYSEX_MANUFACTURER);
+    CHECK(msg[2] == SYSEX_FIRMWARE_UPLOAD);
+    CHECK(decodeInt(msg+3) == (uint32_t)i);
+    uint8_t decoded[binblock];
+    CHECK(sysex_to_data(msg+MESSAGE_SIZE, decoded, sysexLength(binblock)) == binblock);
+    CHECK(memcmp(decoded, data+i*binblock, binblock) == 0);
+  }
+}
+
+int main(){
+  testEncodeStaysInBounds();
+  testJobsOutOfOrder();
+  return failures == 0 ? 0 : 1;
+}
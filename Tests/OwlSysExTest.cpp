@@ -0,0 +1,73 @@
+#include <string.h>
+#include <vector>
+#include "owlsysex.h"
+#include "TestMain.h"
+
+/* owl_sysex_length() is all a caller has to size the output with */
+static void testEncodeFitsLength(){
+  for(size_t len=0; len<=30; ++len){
+    std::vector<uint8_t> data(len, 0x81);
+    size_t size = owl_sysex_length(len);
+    std::vector<uint8_t> sysex(size+1, 0xaa);
+    CHECK(owl_encode(data.data(), len, sysex.data()) == size);
+    CHECK(sysex[size] == 0xaa);
+    std::vector<uint8_t> decoded(len+1);
+    CHECK(owl_decode(sysex.data(), size, decoded.data()) == len);
+    CHECK(memcmp(decoded.data(), data.data(), len) == 0);
+  }
+}
+
+/* lengths past 2 GiB must not wrap around */
+static void testLargeLength(){
+  if(sizeof(size_t) <= 4)
+    return;
+  size_t len = (size_t)3 << 30; // 3 GiB, leaves 3 bytes over in its last group
+  CHECK(owl_sysex_length(len) == len/7*8 + 4);
+  CHECK(owl_frame_length(len) == 1+8+len/7*8+4+1);
+}
+
+static void testFrameFitsLength(){
+  uint8_t payload[21] = { 0xff };
+  size_t size = owl_frame_length(sizeof(payload));
+  std::vector<uint8_t> frame(size+1, 0xaa);
+  CHECK(owl_frame(OWL_OMNI_DEVICE, 0x10, 1, payload, sizeof(payload), frame.data()) == size);
+  CHECK(frame[size-1] == 0xf7);
+  CHECK(frame[size] == 0xaa);
+}
+
+/* spans are sent as they are, even when they look like an ELF file */
+static void testSpanStaysRaw(){
+  std::vector<uint8_t> data(300);
+  for(size_t i=0; i<data.size(); ++i)
+    data[i] = (uint8_t)(i*7);
+  memcpy(data.data(), "\x7f" "ELF", 4);
+  size_t length = 0;
+  uint8_t* sysex = owl_encode_upload(data.data(), data.size(), NULL, &length);
+  CHECK(sysex != NULL);
+  if(sysex == NULL)
+    return;
+  owl_loader* loader = owl_loader_new();
+  int ret = OWL_LOADER_MORE;
+  for(size_t i=0; i<length && ret == OWL_LOADER_MORE;){
+    size_t end = i;
+    while(end < length && sysex[end] != 0xf7)
+      end++;
+    ret = owl_loader_receive(loader, sysex+i, end+1-i);
+    i = end+1;
+  }
+  CHECK(ret == OWL_LOADER_DONE);
+  size_t size = 0;
+  const uint8_t* received = owl_loader_data(loader, &size);
+  CHECK(received != NULL && size == data.size());
+  CHECK(received != NULL && memcmp(received, data.data(), data.size()) == 0);
+  owl_loader_free(loader);
+  owl_free(sysex);
+}
+
+int main(){
+  testEncodeFitsLength();
+  testFrameFitsLength();
+  testLargeLength();
+  testSpanStaysRaw();
+  return failures == 0 ? 0 : 1;
+}
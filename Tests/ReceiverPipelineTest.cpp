@@ -0,0 +1,101 @@
+#include "UploadEngine.hpp"
+#define FIRMWARE_RECEIVER_NO_MAIN
+#include "FirmwareReceiver.cpp"
+#include "TestMain.h"
+
+/* a receiver with a simulated flash, replying straight to the sender's port */
+class LoopbackReceiver : public FirmwareReceiver {
+public:
+  MidiPort* port = NULL;
+
+  LoopbackReceiver(const juce::File& file, uint8_t id){
+    fileout = new juce::File(file);
+    deviceNum = id;
+    partBuffers = 2;
+    flashLatency = 0;
+    start();
+  }
+
+  void sendReply(const MemoryBlock& block){
+    port->handleIncomingMidiMessage(NULL, juce::MidiMessage::createSysExMessage(block.getData(), block.getSize()));
+  }
+};
+
+/* a sender port that hands each message to the receiver as its worker would */
+class LoopbackPort : public MidiPort {
+private:
+  LoopbackReceiver& receiver;
+public:
+  LoopbackPort(LoopbackReceiver& r) : MidiPort(NULL, "loopback"), receiver(r) {
+    receiver.port = this;
+  }
+
+  bool hasInput() const {
+    return true;
+  }
+
+  void send(const juce::MidiMessage& msg){
+    receiver.handleQueuedMessage(0, msg);
+  }
+};
+
+/* a pipelined upload to one -id is acknowledged by that device */
+static void testPipelineWithDeviceId(){
+  const uint8_t id = 5;
+  const int partSize = 4096;
+  juce::MemoryBlock data(4*partSize);
+  for(size_t i=0; i<data.getSize(); ++i)
+    data[i] = (char)(i*37);
+  juce::TemporaryFile saved;
+  LoopbackReceiver receiver(saved.getFile(), id);
+  UploadResult result;
+  {
+    UploadEngine engine(true); // finds the loopback port in the cache
+    MidiPort::getCache().ports.add(new LoopbackPort(receiver));
+    UploadJob job;
+    job.addSpan(data.getData(), data.getSize()).store(0).addTarget("loopback", id);
+    job.partSize = job.slotSize = partSize;
+    job.pipeline = true;
+    job.blockDelay = 0;
+    result = engine.run(std::move(job));
+  }
+  receiver.finish();
+  CHECK(result.error.isEmpty());
+  CHECK(result.targets.size() == 1);
+  CHECK(result.targets[0].error.isEmpty());
+  juce::MemoryBlock stored;
+  saved.getFile().loadFileAsData(stored);
+  CHECK(stored == data);
+}
+
+/* calibration probes the smallest message size before giving up, and
+ * calibrating from pacing given with the job leaves the tuning cache alone */
+static void testTuneFromMinimumSize(){
+  uint8_t data[1000];
+  for(size_t i=0; i<sizeof(data); ++i)
+    data[i] = (uint8_t)(i*13);
+  juce::TemporaryFile saved;
+  LoopbackReceiver receiver(saved.getFile(), MIDI_SYSEX_OWL_DEVICE);
+  UploadResult result;
+  {
+    UploadEngine engine(true);
+    MidiPort::getCache().ports.add(new LoopbackPort(receiver));
+    UploadJob job;
+    job.addSpan(data, sizeof(data)).addTarget("loopback"); // no store, which is acknowledged late
+    job.autoTune = true;
+    job.messageSize = MIN_AUTO_BLOCK_SIZE;
+    job.blockDelay = 1;
+    result = engine.run(std::move(job));
+  }
+  receiver.finish();
+  CHECK(!result.failed());
+  juce::var tuning = juce::JSON::parse(UploadTarget::getTuningFile())[juce::Identifier("loopback")];
+  CHECK(tuning.isVoid());
+}
+
+int main(){
+  quiet = true;
+  testPipelineWithDeviceId();
+  testTuneFromMinimumSize();
+  return failures == 0 ? 0 : 1;
+}
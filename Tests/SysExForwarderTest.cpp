@@ -0,0 +1,165 @@
+#include <vector>
+#include "SysExForwarder.hpp"
+#include "juce_audio_devices/native/juce_MidiDataConcatenator.h"
+#include "TestMain.h"
+
+/* puts the pieces back together the way the receiver's worker does */
+struct Reassembler {
+  enum { MESSAGE, SYSEX_BEGIN, SYSEX_MORE, SYSEX_END, SYSEX_ABORT };
+  std::vector<uint8_t> partial;
+  std::vector<std::vector<uint8_t> > messages; // complete SysEx messages
+  int aborted = 0;
+  int capacity = -1; // pieces accepted before the queue is full, -1 for no limit
+
+  bool push(int port, int kind, const uint8_t* data, int size){
+    if(capacity == 0)
+      return false;
+    if(capacity > 0)
+      capacity--;
+    if(kind == SYSEX_BEGIN || kind == SYSEX_ABORT)
+      partial.clear();
+    if(kind == SYSEX_ABORT)
+      aborted++;
+    else
+      partial.insert(partial.end(), data, data+size);
+    if(kind == SYSEX_END){
+      messages.push_back(partial);
+      partial.clear();
+    }
+    return true;
+  }
+
+  bool push(int port, const juce::MidiMessage& message){
+    if(message.isSysEx())
+      messages.push_back(std::vector<uint8_t>(message.getRawData(), message.getRawData()+message.getRawDataSize()));
+    return true;
+  }
+};
+
+/* feeds the forwarder from JUCE's concatenator, as the MIDI input does */
+struct Input {
+  Reassembler queue;
+  SysExForwarder<Reassembler> forwarder;
+  juce::MidiDataConcatenator concatenator;
+
+  Input() : forwarder(queue, 0), concatenator(256) {}
+
+  void handleIncomingMidiMessage(void*, const juce::MidiMessage& message){
+    forwarder.handleMessage(message);
+  }
+
+  void handlePartialSysexMessage(void*, const uint8_t* data, int numBytesSoFar, double){
+    forwarder.handlePartial(data, numBytesSoFar);
+  }
+
+  void push(const std::vector<uint8_t>& bytes, size_t from, size_t to){
+    concatenator.pushMidiData(bytes.data()+from, (int)(to-from), 0, (void*)NULL, *this);
+  }
+};
+
+static std::vector<uint8_t> makeSysEx(int size, uint8_t seed){
+  std::vector<uint8_t> msg(size);
+  msg[0] = 0xf0;
+  for(int i=1; i<size-1; ++i)
+    msg[i] = (uint8_t)(seed+i*3) & 0x7f;
+  msg[size-1] = 0xf7;
+  return msg;
+}
+
+/* pieces with realtime bytes in between still make up the message */
+static void testPiecesJoinUp(){
+  Input input;
+  std::vector<uint8_t> msg = makeSysEx(100, 1);
+  uint8_t clock = 0xf8;
+  input.push(msg, 0, 30);
+  input.concatenator.pushMidiData(&clock, 1, 0, (void*)NULL, input);
+  input.push(msg, 30, 60);
+  input.push(msg, 60, 100);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == msg);
+  CHECK(input.queue.aborted == 0);
+}
+
+/* a longer message starting over on a new F0 is not the tail of the first */
+static void testRestartOnNewPiece(){
+  Input input;
+  std::vector<uint8_t> first = makeSysEx(100, 1);
+  std::vector<uint8_t> second = makeSysEx(200, 2);
+  input.push(first, 0, 40);
+  input.push(second, 0, 120);
+  input.push(second, 120, 200);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == second);
+}
+
+/* a new message with the same header is told apart by where the old one stopped */
+static void testRestartWithSameStart(){
+  Input input;
+  std::vector<uint8_t> first = makeSysEx(100, 1);
+  std::vector<uint8_t> second = makeSysEx(200, 2);
+  std::copy(first.begin(), first.begin()+20, second.begin());
+  input.push(first, 0, 40);
+  input.push(second, 0, 120);
+  input.push(second, 120, 200);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == second);
+  CHECK(input.queue.aborted == 1);
+}
+
+/* the same, with the whole new message in one piece */
+static void testRestartWithCompleteMessage(){
+  Input input;
+  std::vector<uint8_t> first = makeSysEx(100, 1);
+  std::vector<uint8_t> second = makeSysEx(200, 2);
+  input.push(first, 0, 40);
+  input.push(second, 0, 200);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == second);
+  CHECK(input.queue.aborted == 1);
+}
+
+/*
+ * An F0 in the middle of a piece cuts the message under way short. The
+ * concatenator passes the new message on as it parses it, which drops
+ * its first data byte as a length, but none of the old one may be in it.
+ */
+static void testRestartWithinPiece(){
+  Input input;
+  std::vector<uint8_t> first = makeSysEx(100, 1);
+  std::vector<uint8_t> second = makeSysEx(200, 2);
+  std::vector<uint8_t> bytes(first.begin(), first.begin()+60);
+  bytes.insert(bytes.end(), second.begin(), second.end());
+  input.push(bytes, 0, 30);
+  input.push(bytes, 30, bytes.size());
+  int used = 0;
+  juce::MidiMessage parsed(second.data(), (int)second.size(), used, 0, 0);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == std::vector<uint8_t>(parsed.getRawData(), parsed.getRawData()+parsed.getRawDataSize()));
+  CHECK(input.queue.aborted == 1);
+}
+
+/* once a piece is lost the rest of the message is dropped, the next one is not */
+static void testQueueFull(){
+  Input input;
+  std::vector<uint8_t> first = makeSysEx(100, 1);
+  std::vector<uint8_t> second = makeSysEx(100, 2);
+  input.push(first, 0, 30);
+  input.queue.capacity = 0;
+  input.push(first, 30, 60);
+  input.queue.capacity = -1;
+  input.push(first, 60, 100);
+  input.push(second, 0, 50);
+  input.push(second, 50, 100);
+  CHECK(input.queue.messages.size() == 1);
+  CHECK(input.queue.messages[0] == second);
+}
+
+int main(){
+  testPiecesJoinUp();
+  testRestartOnNewPiece();
+  testRestartWithSameStart();
+  testRestartWithCompleteMessage();
+  testRestartWithinPiece();
+  testQueueFull();
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,16 @@
+#ifndef __TestMain_H__
+#define __TestMain_H__
+
+#include <stdio.h>
+
+/* a failed check is reported and fails the test, which carries on */
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if(!(cond)){ \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      failures++; \
+    } \
+  } while(0)
+
+#endif // __TestMain_H__